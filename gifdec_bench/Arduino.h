@@ -0,0 +1,36 @@
+#ifndef _ARDUINO_SHIM_H_
+#define _ARDUINO_SHIM_H_
+
+// Just enough of the Arduino core to build the decoder on a PC
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#define HEX 16
+
+class HostSerial {
+    public:
+        void print(const char* s) { fputs(s, stderr); }
+        void print(long v, int base = 10) { fprintf(stderr, base == HEX ? "%lx" : "%ld", v); }
+        void println(const char* s) { fprintf(stderr, "%s\n", s); }
+        void println(long v, int base = 10) { fprintf(stderr, base == HEX ? "%lx\n" : "%ld\n", v); }
+        void println() { fputc('\n', stderr); }
+};
+
+extern HostSerial Serial;
+
+static inline unsigned long micros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static inline unsigned long millis() {
+    return micros() / 1000;
+}
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef _SD_SHIM_H_
+#define _SD_SHIM_H_
+
+// File stand-in backed by a POSIX file descriptor. Every call that would go
+// through the SD library is counted, since that's what dominates on the board
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include "Arduino.h"
+
+enum SeekMode {
+    SeekSet = 0,
+    SeekCur = 1,
+    SeekEnd = 2
+};
+
+class File {
+    public:
+        static unsigned long read_calls, read_bytes, seek_calls;
+
+        File() {}
+
+        File(const char* path) {
+            fd = open(path, O_RDONLY);
+        }
+
+        size_t read(uint8_t* buf, size_t size) {
+            ssize_t got;
+
+            read_calls++;
+            got = ::read(fd, buf, size);
+            if (got <= 0)
+                return 0;
+            read_bytes += got;
+            return got;
+        }
+
+        bool seek(uint32_t pos, SeekMode mode) {
+            seek_calls++;
+            return lseek(fd, (off_t) pos, mode == SeekSet ? SEEK_SET : mode == SeekCur ? SEEK_CUR : SEEK_END) >= 0;
+        }
+
+        size_t position() {
+            return lseek(fd, 0, SEEK_CUR);
+        }
+
+        void close() {
+            if (fd >= 0)
+                ::close(fd);
+            fd = -1;
+        }
+
+        operator bool() {
+            return fd >= 0;
+        }
+
+    private:
+        int fd = -1;
+};
+
+#endif
@@ -0,0 +1,195 @@
+// Decode GIFs with gifdec on the host and report how fast, and how much SD
+// traffic it would have caused.
+//
+//   ./bench [-l loops] [-b] [-s size] [-t] [-S] file.gif...
+//
+// -b decodes to big-endian pixels, like the ESP32 renderer does.
+// -s scales to fit size x size, like the renderer does with its screen size.
+// -t streams (GD_STREAM): no canvas, bands are copied into the screen buffer
+//    as they come, like the renderer does when there's no memory for one.
+// -S checks seeking instead: every frame reached with gd_seek_frame() must
+//    render the same as when decoded in order. Exits non-zero if not.
+//
+// The checksum covers every rendered frame, so a decoder change that alters
+// output shows up as a different checksum for the same file.
+
+#include <unistd.h>
+#include "SD.h"
+#include "gifdec.h"
+
+HostSerial Serial;
+unsigned long File::read_calls, File::read_bytes, File::seek_calls;
+
+static uint32_t fnv1a(uint32_t hash, const void* data, size_t len) {
+    const uint8_t* p = (const uint8_t*) data;
+
+    while (len--)
+        hash = (hash ^ *p++) * 16777619u;
+    return hash;
+}
+
+// Screen buffer the bands of a streamed GIF go to
+static uint16_t* stream_buffer;
+
+static void stream_band(gd_GIF* gif, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t* pixels) {
+    for (int j = 0; j < h; j++)
+        memcpy(&stream_buffer[(y + j) * gif->out_w + x], &pixels[j * w], w * sizeof(uint16_t));
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench(const char* path, int loops, int size, int mode) {
+    File fp(path);
+    gd_GIF* gif;
+    uint16_t* buffer;
+    uint64_t start, elapsed = 0;
+    unsigned long frames = 0, pixels = 0;
+    uint32_t hash = 2166136261u;
+    int res = 0, loop = 0;
+
+    if (!fp) {
+        fprintf(stderr, "%s: can't open\n", path);
+        return 1;
+    }
+    File::read_calls = File::read_bytes = File::seek_calls = 0;
+    gif = gd_open_gif_scaled(&fp, size, size, mode);
+    if (!gif) {
+        fprintf(stderr, "%s: not a GIF gifdec can read\n", path);
+        fp.close();
+        return 1;
+    }
+    buffer = (uint16_t*) calloc(gif->out_w * gif->out_h, sizeof(uint16_t));
+    stream_buffer = buffer;
+    gif->band = stream_band;
+
+    while (loop < loops) {
+        start = now_ns();
+        res = gd_get_frame(gif);
+        if (res > 0)
+            gd_render_frame(gif, buffer);
+        elapsed += now_ns() - start;
+        if (res < 0) {
+            fprintf(stderr, "%s: decode error after %lu frames\n", path, frames);
+            break;
+        }
+        if (res == 0) {
+            gd_rewind(gif);
+            loop++;
+            continue;
+        }
+        frames++;
+        pixels += gif->fw * gif->fh;
+        hash = fnv1a(hash, buffer, gif->out_w * gif->out_h * sizeof(uint16_t));
+    }
+
+    printf("%-32s %4ux%-4u %6lu %8.2f %9.1f %10lu %8lu %6lu  %08x\n",
+        path, gif->width, gif->height, frames,
+        pixels ? (double) elapsed / pixels : 0.0,
+        elapsed ? frames * 1e9 / elapsed : 0.0,
+        File::read_bytes, File::read_calls, File::seek_calls, hash);
+
+    free(buffer);
+    gd_close_gif(gif);
+    return res < 0;
+}
+
+// Decode path in order, keeping a checksum of each frame, then seek to every
+// frame, last first so each seek goes backwards, and compare
+static int check_seek(const char* path, int size) {
+    File fp(path);
+    gd_GIF* gif;
+    uint16_t* buffer;
+    uint32_t* sums = NULL;
+    size_t len;
+    int n = 0, cap = 0, bad = 0;
+
+    if (!fp) {
+        fprintf(stderr, "%s: can't open\n", path);
+        return 1;
+    }
+    gif = gd_open_gif_scaled(&fp, size, size, GD_SCALE_FIT);
+    if (!gif) {
+        fprintf(stderr, "%s: not a GIF gifdec can read\n", path);
+        fp.close();
+        return 1;
+    }
+    len = gif->out_w * gif->out_h * sizeof(uint16_t);
+    buffer = (uint16_t*) malloc(len);
+
+    while (gd_get_frame(gif) > 0) {
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            sums = (uint32_t*) realloc(sums, cap * sizeof(uint32_t));
+        }
+        gd_render_frame(gif, buffer);
+        sums[n++] = fnv1a(2166136261u, buffer, len);
+    }
+    for (int i = n - 1; i >= 0; i--) {
+        if (gd_seek_frame(gif, i) < 0 || gd_get_frame(gif) <= 0) {
+            fprintf(stderr, "%s: can't seek to frame %d\n", path, i);
+            bad++;
+            continue;
+        }
+        gd_render_frame(gif, buffer);
+        if (fnv1a(2166136261u, buffer, len) != sums[i]) {
+            fprintf(stderr, "%s: frame %d differs after seeking\n", path, i);
+            bad++;
+        }
+    }
+    printf("%-32s %4ux%-4u %6d %8d\n", path, gif->width, gif->height, n, bad);
+
+    free(sums);
+    free(buffer);
+    gd_close_gif(gif);
+    return bad != 0;
+}
+
+int main(int argc, char** argv) {
+    int opt, loops = 1, size = 0, mode = GD_SCALE_FIT, failed = 0;
+    bool seek = false;
+
+    while ((opt = getopt(argc, argv, "l:bs:tS")) != -1) {
+        switch (opt) {
+            case 'l':
+                loops = atoi(optarg);
+                break;
+            case 'b':
+                gd_set_colors(1.0f, 255, 1);
+                break;
+            case 's':
+                size = atoi(optarg);
+                break;
+            case 't':
+                mode |= GD_STREAM;
+                break;
+            case 'S':
+                seek = true;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-l loops] [-b] [-s size] [-t] [-S] file.gif...\n", argv[0]);
+                return 2;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-l loops] [-b] [-s size] [-t] [-S] file.gif...\n", argv[0]);
+        return 2;
+    }
+
+    if (seek) {
+        printf("%-32s %9s %6s %8s\n", "file", "size", "frames", "mismatch");
+        for (int i = optind; i < argc; i++)
+            failed |= check_seek(argv[i], size);
+        return failed;
+    }
+
+    // ns/px is per pixel actually decoded (the frame rects), not per canvas pixel
+    printf("%-32s %9s %6s %8s %9s %10s %8s %6s  %8s\n",
+        "file", "size", "frames", "ns/px", "frames/s", "bytes", "reads", "seeks", "checksum");
+    for (int i = optind; i < argc; i++)
+        failed |= bench(argv[i], loops, size, mode);
+    return failed;
+}
@@ -0,0 +1,189 @@
+#!/usr/bin/env python3
+# Write the small GIFs in gifs/ that exercise corners of the format the
+# bundled corpus doesn't. Standard library only; the output is deterministic,
+# so the GIFs are checked in and this only needs running to change them.
+#
+#   python3 fixtures.py
+
+import os
+import random
+import struct
+
+OUT = os.path.join(os.path.dirname(os.path.abspath(__file__)), "gifs")
+
+
+def lzw(pixels, min_size, leading_clear=True, clear_on_grow=False):
+    """LZW-compress pixels into image data sub-blocks. With clear_on_grow,
+    a clear code comes just as the decoder is due to widen codes: the first
+    time at the initial width, then at one wider, and so on."""
+    clear = 1 << min_size
+    out = bytearray()
+    acc = nbits = 0
+
+    def emit(code):
+        nonlocal acc, nbits
+        acc |= code << nbits
+        nbits += size
+        while nbits >= 8:
+            out.append(acc & 0xFF)
+            acc >>= 8
+            nbits -= 8
+
+    def reset():
+        return {(i,): i for i in range(clear)}, clear + 2, min_size + 1
+
+    table, next_code, size = reset()
+    grow_limit = size
+    if leading_clear:
+        emit(clear)
+    prefix = ()
+    for p in pixels:
+        string = prefix + (p,)
+        if string in table:
+            prefix = string
+            continue
+        emit(table[prefix])
+        if next_code < 4096:
+            table[string] = next_code
+            next_code += 1
+            if next_code - 1 == 1 << size and size < 12:
+                size += 1
+            elif clear_on_grow and next_code == 1 << grow_limit:
+                emit(clear)
+                table, next_code, size = reset()
+                grow_limit = min(grow_limit + 1, 11)
+        else:
+            emit(clear)
+            table, next_code, size = reset()
+        prefix = (p,)
+    emit(table[prefix])
+    emit(clear + 1)
+    if nbits:
+        out.append(acc & 0xFF)
+
+    data = bytearray([min_size])
+    for i in range(0, len(out), 255):
+        chunk = out[i:i + 255]
+        data.append(len(chunk))
+        data += chunk
+    data.append(0)
+    return bytes(data)
+
+
+def frame(x, y, w, h, pixels, disposal=1, transparent=None, delay=5,
+          leading_clear=True, clear_on_grow=False, interlace=False):
+    return dict(x=x, y=y, w=w, h=h, pixels=pixels, disposal=disposal,
+                transparent=transparent, delay=delay,
+                leading_clear=leading_clear, clear_on_grow=clear_on_grow,
+                interlace=interlace)
+
+
+def interlaced(pixels, w, h):
+    """Rows in the order an interlaced image stores them."""
+    order = [y for start, step in ((0, 8), (4, 8), (2, 4), (1, 2))
+             for y in range(start, h, step)]
+    return [p for y in order for p in pixels[y * w:(y + 1) * w]]
+
+
+def clip(f, width, height):
+    """f as it shows on a width x height screen: the part of it on the
+    screen, or if there's none, a transparent pixel that changes nothing."""
+    w = min(f["w"], width - f["x"])
+    h = min(f["h"], height - f["y"])
+    if w <= 0 or h <= 0:
+        return frame(0, 0, 1, 1, [0], transparent=0, delay=f["delay"])
+    pixels = [f["pixels"][y * f["w"] + x] for y in range(h) for x in range(w)]
+    return dict(f, w=w, h=h, pixels=pixels)
+
+
+def write_gif(name, width, height, frames, colors=16):
+    bits = max(1, (colors - 1).bit_length())
+    gif = bytearray(b"GIF89a")
+    gif += struct.pack("<HHBBB", width, height, 0x80 | 0x70 | (bits - 1), 0, 0)
+    for i in range(1 << bits):
+        gif += bytes(((i * 53) & 0xFF, (i * 97) & 0xFF, (i * 151) & 0xFF))
+    gif += b"\x21\xff\x0bNETSCAPE2.0\x03\x01\x00\x00\x00"
+    for f in frames:
+        packed = f["disposal"] << 2 | (f["transparent"] is not None)
+        gif += b"\x21\xf9\x04" + struct.pack("<BHB", packed, f["delay"],
+                                             f["transparent"] or 0) + b"\x00"
+        gif += b"," + struct.pack("<HHHHB", f["x"], f["y"], f["w"], f["h"],
+                                  0x40 if f["interlace"] else 0)
+        pixels = f["pixels"]
+        if f["interlace"]:
+            pixels = interlaced(pixels, f["w"], f["h"])
+        gif += lzw(pixels, max(2, bits), f["leading_clear"],
+                   f["clear_on_grow"])
+    gif += b";"
+    with open(os.path.join(OUT, name), "wb") as out:
+        out.write(gif)
+
+
+def noise(w, h, colors, run=4):
+    """Runs of random colors, so LZW strings of all lengths turn up."""
+    pixels = []
+    c = 0
+    for _ in range(w * h):
+        if random.random() < 1 / run:
+            c = random.randrange(colors)
+        pixels.append(c)
+    return pixels
+
+
+def main():
+    random.seed(1)
+    os.makedirs(OUT, exist_ok=True)
+
+    # Image data that doesn't start with a clear code, which is allowed
+    write_gif("noclear.gif", 64, 64, [
+        frame(0, 0, 64, 64, noise(64, 64, 16), leading_clear=False),
+        frame(8, 8, 40, 30, noise(40, 30, 16), leading_clear=False),
+    ])
+
+    # Sprites restored with disposal 3 over a changing background, mixed
+    # with disposal 2, for longer than GD_KEYFRAME_INTERVAL so seeking
+    # starts from keyframes
+    frames = [frame(0, 0, 48, 48, noise(48, 48, 16, run=20))]
+    for i in range(80):
+        x, y = (i * 5) % 40, (i * 3) % 40
+        if i % 10 == 9:
+            frames.append(frame(0, 0, 48, 48, noise(48, 48, 16, run=20),
+                                disposal=1))
+        else:
+            frames.append(frame(x, y, 8, 8, noise(8, 8, 16, run=2),
+                                disposal=3 if i % 3 else 2,
+                                transparent=0))
+    write_gif("dispose3.gif", 48, 48, frames)
+
+    # Frames that don't fit in the logical screen, partly, interlaced or
+    # not, or entirely, including one far past it, and the same frames cut
+    # to the screen, which they must decode the same as. Frames that don't
+    # show at all mustn't be looked up in anything sized to the screen
+    frames = [
+        frame(0, 0, 64, 64, noise(64, 64, 16)),
+        frame(60, 60, 10, 10, noise(10, 10, 16), disposal=2),
+        frame(300, 5, 8, 8, noise(8, 8, 16), disposal=2),
+        frame(5, 40000, 4, 4, noise(4, 4, 16), disposal=3),
+        frame(16, 16, 32, 32, noise(32, 32, 16), disposal=2),
+        frame(40, 10, 30, 20, noise(30, 20, 16, run=2), disposal=3,
+              transparent=0),
+        frame(3, 50, 20, 31, noise(20, 31, 16), interlace=True),
+        frame(50, 45, 25, 37, noise(25, 37, 16, run=2), disposal=2,
+              transparent=0, interlace=True),
+    ]
+    write_gif("offscreen.gif", 64, 64, frames)
+    write_gif("offscreen-ref.gif", 64, 64, [clip(f, 64, 64) for f in frames])
+
+    # Clear codes right after codes get wider, at every width, and the same
+    # frames encoded plainly, which they must decode the same as
+    pixels = [noise(128, 128, 16, run=2), noise(40, 30, 4)]
+    for name, clear_on_grow in (("growclear.gif", True),
+                                ("growclear-ref.gif", False)):
+        write_gif(name, 128, 128, [
+            frame(0, 0, 128, 128, pixels[0], clear_on_grow=clear_on_grow),
+            frame(8, 8, 40, 30, pixels[1], clear_on_grow=clear_on_grow),
+        ])
+
+
+if __name__ == "__main__":
+    main()
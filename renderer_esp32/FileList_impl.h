@@ -3,20 +3,70 @@
 
 #include <SD.h>
 #include "prefs.h"
-
+#include "catalog.h"
+#include "playlist.h"
+
+// Playlist of the GIFs in a directory and its subdirectories. Paths come
+// from the in-RAM playlist, or if that doesn't fit from the on-card catalog,
+// one entry read per move.
+// next_file()/prev_file() follow the play order, which is shuffled when
+// prefs have a shuffle seed and the playlist is in RAM; indexes are always in
+// path order
 class FileList {
     public:
         FileList(const char* directory) {
             this->directory = directory;
-            // this->read_num_files(0, true);
+            this->filename[0] = 0;
+            this->next_filename[0] = 0;
         }
 
         void init(Prefs* prefs) {
-            this->read_num_files(0, true, prefs->last_filename);
+            int index;
+
+            this->open(catalog_open(this->directory), prefs->shuffle_seed);
+            index = playlist_count() ? playlist_find(prefs->last_filename) : catalog_find(prefs->last_filename);
+            this->load(index < 0 ? 0 : index);
         }
 
         void init() {
-            this->read_num_files(0, true);
+            this->open(catalog_open(this->directory), 0);
+            this->load(0);
+        }
+
+        // Refresh the catalog right away, e.g. when a file in it can't be
+        // opened any more. Returns false if nothing had changed
+        bool rescan() {
+            int num_files;
+
+            catalog_refresh(this->directory);
+            while (catalog_scan_step())
+                ;
+            if ((num_files = catalog_poll()) < 0)
+                return false;
+            this->reload(num_files);
+            return true;
+        }
+
+        // Take on a refreshed catalog of num_files GIFs, keeping the current
+        // file if it's still there
+        void reload(int num_files) {
+            char current[CATALOG_PATH_LEN];
+            int index;
+
+            strcpy(current, this->filename);
+            this->open(num_files, this->seed);
+            index = playlist_count() ? playlist_find(current) : catalog_find(current);
+            this->load(index < 0 ? this->index : index);
+        }
+
+        // Switch to the play order for seed (0 for path order), keeping the
+        // current file
+        void shuffle(uint32_t seed) {
+            if (seed == this->seed)
+                return;
+            this->seed = seed;
+            playlist_shuffle(seed);
+            this->load(this->index);
         }
 
         int get_num_files() {
@@ -31,103 +81,81 @@ class FileList {
             return this->filename;
         }
 
+        // What next_file() will switch to
+        const char* get_next_file() {
+            return this->next_filename;
+        }
+
         void set_file(int index) {
-            this->read_num_files(index, true);
+            this->load(index);
         }
 
         void next_file(Prefs* prefs) {
-            this->change_file(prefs, 1, true);
+            this->change_file(prefs, 1);
         }
 
         void prev_file(Prefs* prefs) {
-            this->change_file(prefs, -1, true);
+            this->change_file(prefs, -1);
         }
 
     private:
         const char* directory;
-        char filename[128];
+        char filename[CATALOG_PATH_LEN], next_filename[CATALOG_PATH_LEN];
         int num_files = 0, index = 0;
+        uint32_t seed = 0;
+
+        void open(int num_files, uint32_t seed) {
+            this->num_files = num_files;
+            this->seed = seed;
+            if (playlist_load(num_files))
+                playlist_shuffle(seed);
+        }
+
+        // Position after pos in the play order, dir -1 or 1, wrapping around
+        int step(int pos, int dir) {
+            pos += dir;
+            if (pos >= this->num_files)
+                return 0;
+            if (pos < 0)
+                return this->num_files - 1;
+            return pos;
+        }
 
-        void change_file(Prefs* prefs, int dir, bool set_index) {
-            this->read_num_files(this->index + dir, set_index);
+        void change_file(Prefs* prefs, int dir) {
+            if (this->num_files)
+                this->load(playlist_at(this->step(playlist_position(this->index), dir)));
             if (prefs != NULL) {
                 set_pref_last_filename(prefs, (const char *)this->filename);
-                write_prefs(prefs);
+                save_prefs(prefs);
             }
         }
 
-        void read_num_files(int index, bool set_index, char* last_filename) {
-            int count = 0, curindex = -1;
-
-            if (set_index) {
-                if (index >= this->num_files) {
-                    index = 0;
-                } else if (index < 0) {
-                    index = this->num_files - 1;
-                }
+        void load(int index) {
+            if (index >= this->num_files) {
+                index = 0;
+            } else if (index < 0) {
+                index = this->num_files - 1;
             }
-
-            File directory = SD.open(this->directory);
-            if (!directory) {
+            if (!this->get_path(index, this->filename))
                 return;
-            }
-
-            File file = directory.openNextFile();
-            while (file) {
-                if (this->is_anim_file(file.name())) {
-                    count++;
-                    curindex++;
-                    if (set_index && ((last_filename != NULL && strcmp((char*)file.name(), last_filename) == 0 || (last_filename == NULL && index == curindex)))) {
-                        this->index = curindex;
-#if !defined(ESP32)
-                        // Copy the directory name into the pathname buffer - ESP32 SD Library includes the full path name in the filename, so no need to add the directory name
-                        strcpy(this->filename, this->directory);
-                        // Append the filename to the pathname
-                        strcat(this->filename, (char*)file.name());
-#else
-                        strcpy(this->filename, (char*)file.name());
-#endif
-                    }
-                }
-                file.close();
-                file = directory.openNextFile();
-            }
-
-            file.close();
-            directory.close();
-
-            this->num_files = count;
-        }
-
-        void read_num_files(int index, bool set_index) {
-            this->read_num_files(index, set_index, NULL);
+            this->index = index;
+            // Resolved now so the next GIF can be opened ahead of time
+            // without touching the catalog
+            if (!this->get_path(playlist_at(this->step(playlist_position(index), 1)), this->next_filename))
+                strcpy(this->next_filename, this->filename);
         }
 
-        bool is_anim_file(const char* filename) {
-            String filename_string(filename);
-
-#if defined(ESP32)
-            // ESP32 filename includes the full path, so need to remove the path before looking at the filename
-            int pathindex = filename_string.lastIndexOf("/");
-            if (pathindex >= 0)
-                filename_string.remove(0, pathindex + 1);
-#endif
-
-            Serial.print(filename_string);
+        bool get_path(int index, char* path) {
+            CatalogEntry entry;
+            const char* name = playlist_path(index);
 
-            if ((filename_string[0] == '_') || (filename_string[0] == '~') || (filename_string[0] == '.')) {
-                Serial.println(" ignoring: leading _/~/. character");
-                return false;
+            if (!name) {
+                if (!catalog_get(index, &entry))
+                    return false;
+                name = entry.path;
             }
-
-            filename_string.toUpperCase();
-            if (filename_string.endsWith(".GIF") != 1) {
-                Serial.println(" ignoring: doesn't end with .GIF");
-                return false;
-            }
-
-            Serial.println();
-
+            // Catalog paths are full paths from the root of the card
+            strcpy(path, name);
             return true;
         }
 };
@@ -0,0 +1,345 @@
+#ifndef _FRAMECACHE_IMPL_H_
+#define _FRAMECACHE_IMPL_H_
+
+#include <Arduino.h>
+#include "display.h"
+#include "catalog.h"
+
+// Memory to spend on keeping decoded frames. If PSRAM is present and its
+// budget isn't 0 the cache lives there, otherwise in internal RAM. A budget
+// of 0 turns that tier off
+#ifndef FRAME_CACHE_PSRAM_BUDGET
+#define FRAME_CACHE_PSRAM_BUDGET 0
+#endif
+#ifndef FRAME_CACHE_RAM_BUDGET
+#define FRAME_CACHE_RAM_BUDGET (32 * 1024)
+#endif
+// Most GIFs kept at once
+#define FRAME_CACHE_FILES 8
+
+// Frame data is a sequence of 16 bit tokens covering the frame's rect row by
+// row: the operation in the top two bits, a pixel count in the rest
+#define FC_SKIP 0x0000  // pixels unchanged from the previous frame
+#define FC_FILL 0x4000  // pixels of the one color that follows
+#define FC_COPY 0x8000  // pixels that follow
+#define FC_OP_MASK 0xC000
+#define FC_COUNT_MAX 0x3FFF
+
+typedef struct {
+    Rect rect;        // only area that differs from the previous frame
+    uint16_t delay;
+} CachedFrame;
+
+typedef struct {
+    uint32_t key;               // hash of name, to skip most compares
+    char name[CATALOG_PATH_LEN];
+    uint16_t width, height;
+    size_t offset, size;
+    uint32_t last_used;
+} CachedGIF;
+
+// Records the frames of a GIF the first time through. If the whole loop fits
+// in the budget, later loops - and later visits to the same file, as long as
+// it hasn't been evicted - are replayed from memory, with no SD reads and no
+// LZW decoding. Otherwise recording is abandoned and the GIF keeps streaming.
+//
+// Each frame is stored as the area that may have changed since the previous
+// one (the previous rect, which disposal may have touched, plus its own),
+// run-length encoded against the previous frame, so sprite animations and
+// flat backgrounds take very little room. Replay applies each frame on top of
+// a copy of the one before it. The first frame always covers the whole screen, so every loop looks
+// exactly like the first.
+//
+// GIFs are kept back to back in one block. A recording only uses the free
+// space after them; if it runs out, the rest of the loop is only measured.
+// When the whole loop fits the budget, the least recently played GIFs are
+// evicted at the end of it, the rest moved down, and the next loop recorded.
+class FrameCache {
+    public:
+        void begin() {
+#if FRAME_CACHE_PSRAM_BUDGET > 0
+            if (psramFound() && (this->mem = (uint8_t*) ps_malloc(FRAME_CACHE_PSRAM_BUDGET)))
+                this->budget = FRAME_CACHE_PSRAM_BUDGET;
+#endif
+#if FRAME_CACHE_RAM_BUDGET > 0
+            if (!this->mem && (this->mem = (uint8_t*) malloc(FRAME_CACHE_RAM_BUDGET)))
+                this->budget = FRAME_CACHE_RAM_BUDGET;
+#endif
+        }
+
+        // Switch to the GIF called name, of the given size. Replays it if it
+        // was cached before, records it otherwise. Names too long to keep
+        // a copy of aren't cached
+        void reset(const char* name, uint16_t width, uint16_t height) {
+            CachedGIF* gif;
+
+            if (this->state == RECORDING)
+                this->used = this->rec_start;
+            this->state = OFF;
+            this->measured = 0;
+            this->width = width;
+            this->height = height;
+            this->prev = (Rect) {0, 0, 0, 0};
+            if (!this->mem || strlen(name) >= CATALOG_PATH_LEN)
+                return;
+
+            this->key = hash(name);
+            strcpy(this->name, name);
+            if ((gif = this->find(this->key, name)) && gif->width == width && gif->height == height) {
+                gif->last_used = ++this->clock;
+                this->replay_from(gif);
+                return;
+            }
+            this->rec_start = this->used;
+            this->state = RECORDING;
+        }
+
+        bool replaying() {
+            return this->state == REPLAYING;
+        }
+
+        // Store a decoded frame. pixels is the whole composited frame, prev
+        // the previous one (ignored for the first), rect the area the frame's
+        // image descriptor covered
+        void record(const uint16_t* pixels, const uint16_t* prev, const Rect* rect, uint16_t delay) {
+            CachedFrame header;
+            size_t start = this->used;
+
+            if (this->state != RECORDING && this->state != MEASURING)
+                return;
+            if (this->state == RECORDING && this->used == this->rec_start) {
+                header.rect = (Rect) {0, 0, this->width, this->height};
+                prev = NULL;
+            } else {
+                header.rect = this->prev;
+                rect_union(&header.rect, rect);
+            }
+            header.delay = delay;
+            this->prev = *rect;
+
+            if (this->state == RECORDING) {
+                if (this->put(&header, sizeof(header)) && this->encode(pixels, prev, &header.rect))
+                    return;
+                // Out of free space. Other GIFs are only evicted for a loop
+                // known to fit, so measure the rest of this one
+                this->measured = start - this->rec_start;
+                this->used = this->rec_start;
+                if (!this->count) {
+                    // Nothing to evict, keep streaming this one
+                    this->state = OFF;
+                    return;
+                }
+                this->state = MEASURING;
+            }
+            this->put(&header, sizeof(header));
+            this->encode(pixels, prev, &header.rect);
+            if (this->measured > this->budget)
+                this->state = OFF;
+        }
+
+        // The decoder reached the end of the animation. Returns whether every
+        // frame was recorded, in which case replay() takes over
+        bool finish() {
+            CachedGIF* gif;
+
+            if (this->state == MEASURING) {
+                // Make room for the whole loop and record the next one
+                while (this->used + this->measured > this->budget && this->evict_lru())
+                    ;
+                this->rec_start = this->used;
+                this->measured = 0;
+                this->state = RECORDING;
+                return false;
+            }
+            if (this->state != RECORDING || this->used == this->rec_start)
+                return this->replaying();
+            if (this->count == FRAME_CACHE_FILES)
+                this->evict_lru();
+            gif = &this->gifs[this->count++];
+            gif->key = this->key;
+            strcpy(gif->name, this->name);
+            gif->width = this->width;
+            gif->height = this->height;
+            gif->offset = this->rec_start;
+            gif->size = this->used - this->rec_start;
+            gif->last_used = ++this->clock;
+            this->replay_from(gif);
+            return true;
+        }
+
+        // Rebuild the next cached frame in pixels from prev, the previously
+        // replayed or recorded frame (NULL, or anything, for the first one).
+        // prev may be pixels itself
+        void replay(const uint16_t* prev, uint16_t* pixels, Rect* rect, uint16_t* delay) {
+            CachedFrame header;
+            uint32_t pos = 0, total;
+            uint16_t token, color = 0, count, n, col;
+            uint16_t* dst;
+
+            if (this->cursor == this->replay_end)
+                this->cursor = this->replay_start;
+            if (prev && prev != pixels)
+                memcpy(pixels, prev, this->width * this->height * sizeof(uint16_t));
+            memcpy(&header, this->mem + this->cursor, sizeof(header));
+            this->cursor += sizeof(header);
+
+            total = header.rect.w * header.rect.h;
+            while (pos < total) {
+                token = this->get();
+                count = token & FC_COUNT_MAX;
+                if ((token & FC_OP_MASK) == FC_FILL)
+                    color = this->get();
+                // Runs carry on across rows of the rect
+                while (count) {
+                    col = pos % header.rect.w;
+                    n = header.rect.w - col;
+                    if (n > count)
+                        n = count;
+                    dst = pixels + (header.rect.y + pos / header.rect.w) * this->width + header.rect.x + col;
+                    if ((token & FC_OP_MASK) == FC_COPY) {
+                        memcpy(dst, this->mem + this->cursor, n * sizeof(uint16_t));
+                        this->cursor += n * sizeof(uint16_t);
+                    } else if ((token & FC_OP_MASK) == FC_FILL) {
+                        for (uint16_t i = 0; i < n; i++)
+                            dst[i] = color;
+                    }
+                    count -= n;
+                    pos += n;
+                }
+            }
+            *rect = header.rect;
+            *delay = header.delay;
+        }
+
+    private:
+        enum {OFF, RECORDING, MEASURING, REPLAYING} state = OFF;
+        uint8_t* mem = NULL;
+        size_t budget = 0, used = 0;
+        size_t measured = 0;  // bytes the loop being measured would take
+        CachedGIF gifs[FRAME_CACHE_FILES];
+        uint8_t count = 0;
+        uint32_t clock = 0;
+        // Current GIF
+        uint32_t key = 0;
+        char name[CATALOG_PATH_LEN];
+        uint16_t width = 0, height = 0;
+        Rect prev;
+        size_t rec_start = 0, replay_start = 0, replay_end = 0, cursor = 0;
+
+        static uint32_t hash(const char* s) {
+            uint32_t h = 2166136261u;
+
+            while (*s)
+                h = (h ^ (uint8_t) *s++) * 16777619u;
+            return h;
+        }
+
+        CachedGIF* find(uint32_t key, const char* name) {
+            for (uint8_t i = 0; i < this->count; i++) {
+                if (this->gifs[i].key == key && !strcmp(this->gifs[i].name, name))
+                    return &this->gifs[i];
+            }
+            return NULL;
+        }
+
+        void replay_from(CachedGIF* gif) {
+            this->replay_start = this->cursor = gif->offset;
+            this->replay_end = gif->offset + gif->size;
+            this->state = REPLAYING;
+        }
+
+        // Drop the least recently played GIF and close the gap. Anything
+        // being recorded is always after every cached GIF, so it moves too
+        bool evict_lru() {
+            uint8_t lru = 0;
+            size_t end;
+
+            if (!this->count)
+                return false;
+            for (uint8_t i = 1; i < this->count; i++) {
+                if (this->gifs[i].last_used < this->gifs[lru].last_used)
+                    lru = i;
+            }
+            end = this->gifs[lru].offset + this->gifs[lru].size;
+            memmove(this->mem + this->gifs[lru].offset, this->mem + end, this->used - end);
+            for (uint8_t i = 0; i < this->count; i++) {
+                if (this->gifs[i].offset > this->gifs[lru].offset)
+                    this->gifs[i].offset -= this->gifs[lru].size;
+            }
+            this->used -= this->gifs[lru].size;
+            this->rec_start -= this->gifs[lru].size;
+            this->gifs[lru] = this->gifs[--this->count];
+            return true;
+        }
+
+        // Store size bytes at the end, or while measuring only count them
+        bool put(const void* data, size_t size) {
+            if (this->state == MEASURING) {
+                this->measured += size;
+                return true;
+            }
+            if (this->used + size > this->budget)
+                return false;
+            memcpy(this->mem + this->used, data, size);
+            this->used += size;
+            return true;
+        }
+
+        uint16_t get() {
+            uint16_t v;
+
+            memcpy(&v, this->mem + this->cursor, sizeof(v));
+            this->cursor += sizeof(v);
+            return v;
+        }
+
+        // i-th pixel of rect, row by row
+        uint32_t offset(const Rect* rect, uint32_t i) {
+            return (rect->y + i / rect->w) * this->width + rect->x + i % rect->w;
+        }
+
+        // Encode rect of pixels as tokens. With prev, pixels that match it
+        // are skipped; otherwise every pixel is stored
+        bool encode(const uint16_t* pixels, const uint16_t* prev, const Rect* rect) {
+            uint32_t i = 0, j, total = rect->w * rect->h;
+            uint16_t token, color;
+
+            while (i < total) {
+                color = pixels[this->offset(rect, i)];
+                j = i + 1;
+                if (prev && color == prev[this->offset(rect, i)]) {
+                    while (j < total && j - i < FC_COUNT_MAX && pixels[this->offset(rect, j)] == prev[this->offset(rect, j)])
+                        j++;
+                    token = FC_SKIP | (j - i);
+                    if (!this->put(&token, sizeof(token)))
+                        return false;
+                } else {
+                    while (j < total && j - i < FC_COUNT_MAX && pixels[this->offset(rect, j)] == color)
+                        j++;
+                    if (j - i >= 3) {
+                        token = FC_FILL | (j - i);
+                        if (!this->put(&token, sizeof(token)) || !this->put(&color, sizeof(color)))
+                            return false;
+                    } else {
+                        // Literal run, up to the next skip or fill
+                        while (j < total && j - i < FC_COUNT_MAX
+                                && !(prev && pixels[this->offset(rect, j)] == prev[this->offset(rect, j)])
+                                && !(j + 2 < total && pixels[this->offset(rect, j)] == pixels[this->offset(rect, j + 1)]
+                                    && pixels[this->offset(rect, j)] == pixels[this->offset(rect, j + 2)]))
+                            j++;
+                        token = FC_COPY | (j - i);
+                        if (!this->put(&token, sizeof(token)))
+                            return false;
+                        for (uint32_t k = i; k < j; k++) {
+                            if (!this->put(&pixels[this->offset(rect, k)], sizeof(uint16_t)))
+                                return false;
+                        }
+                    }
+                }
+                i = j;
+            }
+            return true;
+        }
+};
+
+#endif
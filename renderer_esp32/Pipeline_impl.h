@@ -0,0 +1,251 @@
+#ifndef _PIPELINE_IMPL_H_
+#define _PIPELINE_IMPL_H_
+
+#include <atomic>
+#include "gifdec.h"
+#include "display.h"
+#include "FrameCache_impl.h"
+#include "catalog.h"
+#include "prefs.h"
+
+// Decode task placement. loop() runs on core 1, so decoding goes on core 0
+#define PIPELINE_DEPTH 2
+#define PIPELINE_CORE 0
+#define PIPELINE_STACK 8192
+#define PIPELINE_PRIORITY 1
+// How GIFs that aren't SCREEN_W x SCREEN_H are scaled, see gd_open_gif_scaled()
+#define PIPELINE_SCALE GD_SCALE_FIT
+
+typedef struct {
+    uint16_t* pixels;
+    Rect rect;        // area of the screen the frame's image descriptor covered,
+                      // or all of it for the first frame of a loop
+    uint16_t delay;   // how long to show it, in centiseconds
+    int status;       // gd_get_frame() result, < 0 on decode error
+    gd_Timing timing; // time the decoder spent on it
+    bool big_endian;  // byte order of pixels, see gd_GIF
+} Frame;
+
+// Decodes frames on a task pinned to PIPELINE_CORE while loop() shows the
+// previous ones. Decoded frames are handed over through a single-producer,
+// single-consumer ring of PIPELINE_DEPTH screen buffers, so neither side
+// ever takes a lock: the decode task only moves head, loop() only moves next
+// and tail. A frame stays owned by loop() from acquire() until release(), so
+// it can still be on its way to the TFT while the next one is acquired.
+class Pipeline {
+    public:
+        Pipeline(uint16_t* buffers, size_t buffer_pixels) {
+            for (int i = 0; i < PIPELINE_DEPTH; i++)
+                this->frames[i].pixels = buffers + i * buffer_pixels;
+        }
+
+        // Open a GIF scaled to the screen
+        static gd_GIF* open(File* fp) {
+            return gd_open_gif_scaled(fp, SCREEN_W, SCREEN_H, PIPELINE_SCALE);
+        }
+
+        void begin() {
+            this->cache.begin();
+            xTaskCreatePinnedToCore(Pipeline::task_main, "decode", PIPELINE_STACK, this, PIPELINE_PRIORITY, &this->task, PIPELINE_CORE);
+        }
+
+        // Drop anything queued and start decoding gif. name identifies it in
+        // the frame cache
+        void start(gd_GIF* gif, const char* name) {
+            this->pause();
+            this->gif = gif;
+            this->last = NULL;
+            // A prefetched GIF already has its first frame decoded
+            this->predecoded = gif == this->taken;
+            this->taken = NULL;
+            this->cache.reset(name, gif->out_w, gif->out_h);
+            this->head.store(0, std::memory_order_relaxed);
+            this->tail.store(0, std::memory_order_relaxed);
+            this->next = 0;
+            this->resume();
+        }
+
+        // Let the decode task run again after pause()
+        void resume() {
+            this->parked.store(false);
+            this->running.store(true);
+            xTaskNotifyGive(this->task);
+        }
+
+        // Stop the decode task at the next frame boundary and wait for it, so
+        // the caller may touch the GIF, the SD card and the catalog, which
+        // it refreshes in between frames along with writing out prefs.
+        // Queued frames are kept
+        void pause() {
+            this->running.store(false);
+            xTaskNotifyGive(this->task);
+            while (!this->parked.load())
+                delay(1);
+        }
+
+        // Open path and decode its first frame in the background, between
+        // frames of the current GIF, so switching to it doesn't stall the
+        // screen. Ignored while an earlier prefetch hasn't been taken
+        void prefetch(const char* path) {
+            if (this->ahead_state.load() != AHEAD_NONE)
+                return;
+            strncpy(this->ahead.path, path, CATALOG_PATH_LEN - 1);
+            this->ahead.path[CATALOG_PATH_LEN - 1] = 0;
+            this->ahead_state.store(AHEAD_REQUESTED, std::memory_order_release);
+            xTaskNotifyGive(this->task);
+        }
+
+        // The prefetched GIF if it's path, NULL otherwise. fp takes over its
+        // file. Anything else prefetched is closed. Only call while paused
+        gd_GIF* take_prefetched(const char* path, File* fp) {
+            gd_GIF* gif = NULL;
+
+            if (this->ahead_state.load(std::memory_order_acquire) == AHEAD_READY && this->ahead.gif) {
+                if (!strcmp(path, this->ahead.path)) {
+                    *fp = this->ahead.file;
+                    gif = this->ahead.gif;
+                    gif->fd = fp;
+                    this->taken = gif;
+                    this->taken_status = this->ahead.status;
+                } else {
+                    gd_close_gif(this->ahead.gif);
+                }
+            }
+            this->ahead.gif = NULL;
+            this->ahead.file = File();
+            this->ahead_state.store(AHEAD_NONE);
+            return gif;
+        }
+
+        // Next decoded frame, or NULL if the decode task hasn't caught up
+        Frame* acquire() {
+            if (this->next == this->head.load(std::memory_order_acquire))
+                return NULL;
+            return &this->frames[this->next++ % PIPELINE_DEPTH];
+        }
+
+        // Give the oldest acquired frame's buffer back to the decode task
+        void release() {
+            this->tail.store(this->tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+            xTaskNotifyGive(this->task);
+        }
+
+    private:
+        Frame frames[PIPELINE_DEPTH];
+        std::atomic<uint32_t> head{0}, tail{0};
+        uint32_t next = 0;
+        std::atomic<bool> running{false}, parked{true};
+        TaskHandle_t task = NULL;
+        gd_GIF* gif = NULL;
+        FrameCache cache;
+        // Pixels of the last decoded frame. Its buffer isn't written again
+        // until after the next frame is decoded
+        uint16_t* last = NULL;
+        // Prefetching is handed to the decode task through ahead_state: loop()
+        // only moves it NONE -> REQUESTED and, while paused, back to NONE; the
+        // task only moves it REQUESTED -> READY
+        enum {AHEAD_NONE, AHEAD_REQUESTED, AHEAD_READY};
+        std::atomic<int> ahead_state{AHEAD_NONE};
+        struct {
+            char path[CATALOG_PATH_LEN];
+            File file;
+            gd_GIF* gif;
+            int status;
+        } ahead = {};
+        gd_GIF* taken = NULL;
+        int taken_status = 0;
+        bool predecoded = false;
+
+        static void task_main(void* arg) {
+            Pipeline* p = (Pipeline*) arg;
+            uint32_t head;
+
+            while (true) {
+                if (!p->running.load()) {
+                    p->parked.store(true);
+                    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+                    continue;
+                }
+                if (p->ahead_state.load(std::memory_order_acquire) == AHEAD_REQUESTED) {
+                    p->open_ahead();
+                    continue;
+                }
+                head = p->head.load(std::memory_order_relaxed);
+                if (head - p->tail.load(std::memory_order_acquire) == PIPELINE_DEPTH) {
+                    // Ring is full: get on with refreshing the catalog or
+                    // writing prefs, or sleep until loop() releases a buffer
+                    if (!catalog_scan_step() && !flush_prefs(false))
+                        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+                    continue;
+                }
+                p->decode(&p->frames[head % PIPELINE_DEPTH]);
+                p->head.store(head + 1, std::memory_order_release);
+            }
+        }
+
+        void decode(Frame* frame) {
+            bool rewound = false;
+
+            if (this->cache.replaying()) {
+                this->replay(frame);
+                return;
+            }
+            if (this->predecoded) {
+                frame->status = this->taken_status;
+                this->predecoded = false;
+            } else {
+                frame->status = gd_get_frame(this->gif);
+            }
+            if (frame->status == 0) {
+                if (this->cache.finish()) {
+                    this->replay(frame);
+                    return;
+                }
+                // Loop the animation
+                gd_rewind(this->gif);
+                frame->status = gd_get_frame(this->gif);
+                rewound = true;
+            }
+            if (frame->status <= 0) {
+                frame->status = -1;
+                frame->rect = (Rect) {0, 0, 0, 0};
+                frame->delay = 0;
+                return;
+            }
+            gd_render_frame(this->gif, frame->pixels);
+            gd_output_rect(this->gif, &frame->rect.x, &frame->rect.y, &frame->rect.w, &frame->rect.h);
+            // Rewinding cleared the whole canvas, not just the first frame's
+            // rect, so the whole screen has to go out again
+            if (rewound)
+                frame->rect = (Rect) {0, 0, this->gif->out_w, this->gif->out_h};
+            frame->big_endian = this->gif->big_endian;
+            frame->delay = this->gif->gce.delay;
+            frame->timing = this->gif->timing;
+            this->cache.record(frame->pixels, this->last, &frame->rect, frame->delay);
+            this->last = frame->pixels;
+        }
+
+        // The first frame is decoded into the prefetched GIF's own canvas;
+        // gd_render_frame() copies it out once it's the current one
+        void open_ahead() {
+            this->ahead.file = SD.open(this->ahead.path);
+            this->ahead.gif = this->ahead.file ? Pipeline::open(&this->ahead.file) : NULL;
+            if (this->ahead.gif)
+                this->ahead.status = gd_get_frame(this->ahead.gif);
+            else if (this->ahead.file)
+                this->ahead.file.close();
+            this->ahead_state.store(AHEAD_READY, std::memory_order_release);
+        }
+
+        // Each replayed frame is built from the last one, whose buffer is
+        // still intact (see last)
+        void replay(Frame* frame) {
+            this->cache.replay(this->last, frame->pixels, &frame->rect, &frame->delay);
+            this->last = frame->pixels;
+            frame->status = 1;
+            frame->timing = (gd_Timing) {0, 0, 0};
+            frame->big_endian = this->gif->big_endian;
+        }
+};
+
+#endif
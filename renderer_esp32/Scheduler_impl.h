@@ -0,0 +1,63 @@
+#ifndef _SCHEDULER_IMPL_H_
+#define _SCHEDULER_IMPL_H_
+
+#include <esp_timer.h>
+
+// Delays of 0 or 1 centiseconds are treated as 10, like browsers do - most
+// such GIFs were authored expecting that
+#define SCHED_MIN_DELAY_CS 2
+#define SCHED_DEFAULT_DELAY_CS 10
+// If a frame goes out this late, stop trying to catch up and restart the
+// timeline from now instead of rushing the following frames
+#define SCHED_MAX_LAG_US 100000
+// Waits shorter than a tick are spun, everything else is slept
+#define SCHED_SPIN_US (portTICK_PERIOD_MS * 1000)
+
+// Keeps frame deadlines on a monotonic microsecond timeline. Each deadline is
+// the previous one plus the frame delay, not "now" plus the delay, so time
+// spent decoding and pushing doesn't accumulate as drift.
+class FrameScheduler {
+    public:
+        // Next frame is due immediately
+        void reset() {
+            deadline = esp_timer_get_time();
+        }
+
+        bool due() {
+            return esp_timer_get_time() >= deadline;
+        }
+
+        // The frame was just shown; schedule the next one delay_cs later.
+        // Returns how many microseconds after its deadline it went out
+        uint32_t shown(uint16_t delay_cs) {
+            int64_t now = esp_timer_get_time();
+            int64_t late = now - deadline;
+
+            if (delay_cs < SCHED_MIN_DELAY_CS)
+                delay_cs = SCHED_DEFAULT_DELAY_CS;
+            if (late > SCHED_MAX_LAG_US)
+                deadline = now;
+            deadline += (int64_t) delay_cs * 10000;
+            return late > 0 ? late : 0;
+        }
+
+        // Sleep until the deadline, but for no longer than max_us, so the
+        // caller can keep polling buttons
+        void sleep(uint32_t max_us) {
+            int64_t remaining = deadline - esp_timer_get_time();
+
+            if (remaining <= 0)
+                return;
+            if (remaining > max_us)
+                remaining = max_us;
+            if (remaining < SCHED_SPIN_US)
+                delayMicroseconds(remaining);
+            else
+                vTaskDelay(remaining / SCHED_SPIN_US);
+        }
+
+    private:
+        int64_t deadline = 0;
+};
+
+#endif
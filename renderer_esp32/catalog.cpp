@@ -0,0 +1,545 @@
+#include <SD.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <atomic>
+#include "catalog.h"
+
+// Number of entries and directory records in the catalog on the card, once
+// it's been validated
+static int catalog_count = 0, catalog_dirs = 0;
+
+// A refresh lists every directory under the catalog's one, a batch of names
+// per step, and compares each with its record in the catalog. Only the ones
+// that changed are listed again for their GIFs; the entries of the rest are
+// copied over from the old catalog while both are merged into a new one
+enum {
+    SCAN_IDLE,
+    SCAN_DIRS,   // listing directories
+    SCAN_MERGE,  // writing the new catalog
+    SCAN_READY,  // new catalog written, waiting for catalog_poll()
+};
+
+// While scanning, paths are packed into one growing arena; entries and
+// directories only hold offsets into it
+typedef struct {
+    uint32_t path;
+} ScanEntry;
+
+typedef struct {
+    uint32_t path;
+    uint32_t mtime;
+    uint32_t entries;
+    uint32_t names;
+    bool changed;
+} ScanDir;
+
+// Set on the decode task, read by catalog_poll() on the loop task
+static std::atomic<uint8_t> scan_state{SCAN_IDLE};
+
+static char* scan_paths = NULL;
+static int paths_len = 0, paths_cap = 0;
+static ScanEntry* found = NULL;         // GIFs in the directories that changed
+static int found_count = 0, found_cap = 0;
+static ScanDir* dirs = NULL;            // directories found so far
+static int dir_count = 0, dir_cap = 0;
+static ScanDir* old_dirs = NULL;        // directory records of the old catalog, sorted
+static int old_count = 0, old_cap = 0;
+static int* pending = NULL;             // dirs still to be listed
+static int pending_count = 0, pending_cap = 0;
+
+static DIR* scan_dir = NULL;            // directory being listed
+static int cur_dir;
+static bool collecting;                 // second pass over a changed directory
+
+static File old_file, out_file;         // merging
+static CatalogEntry old_entry;
+static bool have_old;
+static int merge_old, merge_new, written;
+
+// Big libraries go in PSRAM when there is some
+static void* catalog_realloc(void* ptr, size_t size) {
+#ifdef ESP32
+    if (psramFound())
+        return ps_realloc(ptr, size);
+#endif
+    return realloc(ptr, size);
+}
+
+// Make room for need elements of size in *array
+static bool grow(void** array, int* cap, int need, size_t size) {
+    void* p;
+    int n;
+
+    if (need <= *cap)
+        return true;
+    n = *cap ? *cap * 2 : 32;
+    while (n < need)
+        n *= 2;
+    if (!(p = catalog_realloc(*array, n * size)))
+        return false;
+    *array = p;
+    *cap = n;
+    return true;
+}
+
+// Copy s into the arena. Returns its offset, or -1 if there's no memory. s
+// mustn't point into the arena, which may move
+static int add_string(const char* s) {
+    int len = strlen(s) + 1, off = paths_len;
+
+    if (!grow((void**) &scan_paths, &paths_cap, paths_len + len, 1))
+        return -1;
+    memcpy(scan_paths + off, s, len);
+    paths_len += len;
+    return off;
+}
+
+static void scan_reset() {
+    if (scan_dir)
+        closedir(scan_dir);
+    scan_dir = NULL;
+    old_file.close();
+    out_file.close();
+    free(scan_paths);
+    free(found);
+    free(dirs);
+    free(old_dirs);
+    free(pending);
+    scan_paths = NULL;
+    found = NULL;
+    dirs = old_dirs = NULL;
+    pending = NULL;
+    paths_len = paths_cap = 0;
+    found_count = found_cap = 0;
+    dir_count = dir_cap = 0;
+    old_count = old_cap = 0;
+    pending_count = pending_cap = 0;
+    scan_state.store(SCAN_IDLE, std::memory_order_release);
+}
+
+static void scan_abort(const char* why) {
+    Serial.print("Catalog refresh failed: ");
+    Serial.println(why);
+    scan_reset();
+}
+
+bool is_anim_file(const char* filename) {
+    const char* base = strrchr(filename, '/');
+    size_t len;
+
+    // ESP32 filename includes the full path, so need to remove the path before looking at the filename
+    base = base ? base + 1 : filename;
+    if (base[0] == '_' || base[0] == '~' || base[0] == '.')
+        return false;
+    len = strlen(base);
+    return len > 4 && strcasecmp(base + len - 4, ".GIF") == 0;
+}
+
+// Directories are skipped by the same rule as files
+static bool is_scan_dir(const char* name) {
+    return name[0] != '_' && name[0] != '~' && name[0] != '.';
+}
+
+// path/name into buf, which holds CATALOG_PATH_LEN. False if it doesn't fit
+static bool join_path(char* buf, const char* path, const char* name) {
+    const char* sep = strcmp(path, "/") ? "/" : "";
+
+    if (strlen(path) + strlen(sep) + strlen(name) >= CATALOG_PATH_LEN)
+        return false;
+    strcpy(buf, path);
+    strcat(buf, sep);
+    strcat(buf, name);
+    return true;
+}
+
+// Where path on the card is for the POSIX calls
+static void mount_path(char* buf, const char* path) {
+    strcpy(buf, CATALOG_MOUNT);
+    if (strcmp(path, "/"))
+        strcat(buf, path);
+}
+
+// FNV-1a of a name. Summed over a directory, so the order names are listed
+// in doesn't matter, and a rename changes it where the count doesn't
+static uint32_t name_hash(const char* name) {
+    uint32_t h = 2166136261u;
+
+    while (*name) {
+        h ^= (uint8_t) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int compare_scan_entries(const void* a, const void* b) {
+    return strcmp(scan_paths + ((const ScanEntry*) a)->path, scan_paths + ((const ScanEntry*) b)->path);
+}
+
+static int compare_scan_dirs(const void* a, const void* b) {
+    return strcmp(scan_paths + ((const ScanDir*) a)->path, scan_paths + ((const ScanDir*) b)->path);
+}
+
+// Binary search a sorted array of n dirs for path
+static ScanDir* find_dir(ScanDir* array, int n, const char* path) {
+    int lo = 0, hi = n - 1, mid, cmp;
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        cmp = strcmp(path, scan_paths + array[mid].path);
+        if (cmp == 0)
+            return &array[mid];
+        if (cmp < 0)
+            hi = mid - 1;
+        else
+            lo = mid + 1;
+    }
+    return NULL;
+}
+
+// Queue path to be listed
+static bool add_dir(const char* path) {
+    int off;
+
+    if (!grow((void**) &dirs, &dir_cap, dir_count + 1, sizeof(ScanDir))
+            || !grow((void**) &pending, &pending_cap, pending_count + 1, sizeof(int))
+            || (off = add_string(path)) < 0)
+        return false;
+    memset(&dirs[dir_count], 0, sizeof(ScanDir));
+    dirs[dir_count].path = off;
+    pending[pending_count++] = dir_count++;
+    return true;
+}
+
+// Nothing is stat()ed: on FAT that's a search of the directory per file
+static bool add_entry(const char* path) {
+    int off;
+
+    if (!grow((void**) &found, &found_cap, found_count + 1, sizeof(ScanEntry))
+            || (off = add_string(path)) < 0)
+        return false;
+    found[found_count++].path = off;
+    return true;
+}
+
+// Read the directory records of the catalog on the card, to compare with
+static bool load_old_dirs() {
+    CatalogDir record;
+    File file;
+    int off;
+
+    if (!catalog_dirs)
+        return true;
+    file = SD.open(CATALOG_FILENAME);
+    if (!file || !file.seek(sizeof(CatalogHeader) + catalog_count * sizeof(CatalogEntry)))
+        return false;
+    for (int i = 0; i < catalog_dirs; i++) {
+        if (file.read((uint8_t*) &record, sizeof(record)) != sizeof(record))
+            break;
+        record.path[CATALOG_PATH_LEN - 1] = 0;
+        if (!grow((void**) &old_dirs, &old_cap, old_count + 1, sizeof(ScanDir))
+                || (off = add_string(record.path)) < 0) {
+            file.close();
+            return false;
+        }
+        old_dirs[old_count].path = off;
+        old_dirs[old_count].mtime = record.mtime;
+        old_dirs[old_count].entries = record.entries;
+        old_dirs[old_count].names = record.names;
+        old_count++;
+    }
+    file.close();
+    // They're written sorted, this is only for a catalog that isn't
+    qsort(old_dirs, old_count, sizeof(ScanDir), compare_scan_dirs);
+    return true;
+}
+
+static void start_merge() {
+    CatalogHeader header;
+    bool changed = false;
+
+    for (int i = 0; i < dir_count; i++)
+        changed |= dirs[i].changed;
+    if (!changed && dir_count == old_count) {
+        Serial.println("Catalog is up to date");
+        scan_reset();
+        return;
+    }
+
+    qsort(found, found_count, sizeof(ScanEntry), compare_scan_entries);
+    qsort(dirs, dir_count, sizeof(ScanDir), compare_scan_dirs);
+    if (catalog_count) {
+        old_file = SD.open(CATALOG_FILENAME);
+        if (!old_file || !old_file.seek(sizeof(CatalogHeader))) {
+            scan_abort("can't read the old catalog");
+            return;
+        }
+    }
+    SD.remove(CATALOG_NEW_FILENAME);
+    out_file = SD.open(CATALOG_NEW_FILENAME, FILE_WRITE);
+    if (!out_file) {
+        scan_abort("can't write " CATALOG_NEW_FILENAME);
+        return;
+    }
+    // Header goes last, so a catalog cut short by a reset never validates
+    memset(&header, 0, sizeof(header));
+    out_file.write((uint8_t*) &header, sizeof(header));
+    have_old = false;
+    merge_old = merge_new = written = 0;
+    scan_state.store(SCAN_MERGE, std::memory_order_relaxed);
+}
+
+// List the next batch of names of the directory being listed, or start on
+// the next one
+static void list_step() {
+    char path[CATALOG_PATH_LEN], full[CATALOG_PATH_LEN + sizeof(CATALOG_MOUNT)];
+    struct dirent* de;
+    struct stat st;
+    ScanDir *d, *old;
+    bool ok = true;
+
+    if (!scan_dir) {
+        if (!pending_count) {
+            start_merge();
+            return;
+        }
+        cur_dir = pending[--pending_count];
+        collecting = false;
+        mount_path(full, scan_paths + dirs[cur_dir].path);
+        // FAT has no timestamps on the root directory, so it stays 0
+        dirs[cur_dir].mtime = stat(full, &st) == 0 ? st.st_mtime : 0;
+        if (!(scan_dir = opendir(full))) {
+            // Gone; its GIFs go with it
+            dirs[cur_dir].changed = true;
+            return;
+        }
+    }
+
+    for (int i = 0; i < CATALOG_SCAN_BATCH && ok; i++) {
+        if (!(de = readdir(scan_dir))) {
+            d = &dirs[cur_dir];
+            if (!collecting) {
+                old = find_dir(old_dirs, old_count, scan_paths + d->path);
+                d->changed = !old || old->mtime != d->mtime || old->entries != d->entries || old->names != d->names;
+                if (d->changed) {
+                    // Go through it again for its GIFs
+                    rewinddir(scan_dir);
+                    collecting = true;
+                    return;
+                }
+            }
+            closedir(scan_dir);
+            scan_dir = NULL;
+            return;
+        }
+        // The catalog itself coming and going isn't a change
+        if (!join_path(path, scan_paths + dirs[cur_dir].path, de->d_name)
+                || !strcmp(path, CATALOG_FILENAME) || !strcmp(path, CATALOG_NEW_FILENAME))
+            continue;
+        if (collecting) {
+            if (de->d_type != DT_DIR && is_anim_file(de->d_name))
+                ok = add_entry(path);
+        } else {
+            dirs[cur_dir].entries++;
+            dirs[cur_dir].names += name_hash(de->d_name);
+            if (de->d_type == DT_DIR && is_scan_dir(de->d_name))
+                ok = add_dir(path);
+        }
+    }
+    if (!ok)
+        scan_abort("out of memory");
+}
+
+// Old entries are kept if their directory is still there and hasn't changed
+static bool keep_old(CatalogEntry* entry) {
+    char dir[CATALOG_PATH_LEN];
+    char* slash;
+    ScanDir* d;
+
+    entry->path[CATALOG_PATH_LEN - 1] = 0;
+    strcpy(dir, entry->path);
+    if (!(slash = strrchr(dir, '/')))
+        return false;
+    slash[slash == dir ? 1 : 0] = 0;
+    d = find_dir(dirs, dir_count, dir);
+    return d && !d->changed;
+}
+
+static void finish_merge() {
+    CatalogHeader header;
+    CatalogDir record;
+
+    for (int i = 0; i < dir_count; i++) {
+        memset(&record, 0, sizeof(record));
+        strcpy(record.path, scan_paths + dirs[i].path);
+        record.mtime = dirs[i].mtime;
+        record.entries = dirs[i].entries;
+        record.names = dirs[i].names;
+        out_file.write((uint8_t*) &record, sizeof(record));
+    }
+    header.version = CATALOG_VERSION;
+    header.path_len = CATALOG_PATH_LEN;
+    header.count = written;
+    header.dir_count = dir_count;
+    out_file.seek(0);
+    out_file.write((uint8_t*) &header, sizeof(header));
+    out_file.close();
+    old_file.close();
+    Serial.print("Catalog refreshed: ");
+    Serial.print(written);
+    Serial.print(" GIFs in ");
+    Serial.print(dir_count);
+    Serial.println(" directories");
+    scan_state.store(SCAN_READY, std::memory_order_release);
+}
+
+// Write the next batch of entries, old and new merged in path order
+static void merge_step() {
+    CatalogEntry entry;
+    ScanEntry* next;
+
+    for (int i = 0; i < CATALOG_SCAN_BATCH; i++) {
+        if (!have_old && merge_old < catalog_count) {
+            merge_old++;
+            have_old = old_file.read((uint8_t*) &old_entry, sizeof(old_entry)) == sizeof(old_entry)
+                && keep_old(&old_entry);
+            continue;
+        }
+        next = merge_new < found_count ? &found[merge_new] : NULL;
+        if (!have_old && !next) {
+            finish_merge();
+            return;
+        }
+        if (have_old && (!next || strcmp(old_entry.path, scan_paths + next->path) < 0)) {
+            out_file.write((uint8_t*) &old_entry, sizeof(old_entry));
+            have_old = false;
+        } else {
+            memset(&entry, 0, sizeof(entry));
+            strcpy(entry.path, scan_paths + next->path);
+            out_file.write((uint8_t*) &entry, sizeof(entry));
+            merge_new++;
+        }
+        written++;
+    }
+}
+
+// Start refreshing the catalog of directory and everything under it. The
+// work is done by catalog_scan_step(); a refresh already running starts over
+void catalog_refresh(const char* directory) {
+    scan_reset();
+    Serial.print("Scanning ");
+    Serial.println(directory);
+    if (!load_old_dirs() || !add_dir(directory)) {
+        scan_abort("can't load the directory records");
+        return;
+    }
+    scan_state.store(SCAN_DIRS, std::memory_order_relaxed);
+}
+
+// Do a little of a refresh, touching the card a batch of entries' worth.
+// Returns false when there's nothing left to do. Only ever called from one
+// task at a time, and never while the catalog is being read elsewhere
+bool catalog_scan_step() {
+    switch (scan_state.load(std::memory_order_relaxed)) {
+        case SCAN_DIRS:
+            list_step();
+            return true;
+        case SCAN_MERGE:
+            merge_step();
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Put a finished refresh in place. Returns the new number of GIFs, or -1 if
+// there's none waiting
+int catalog_poll() {
+    if (scan_state.load(std::memory_order_acquire) != SCAN_READY)
+        return -1;
+    catalog_count = catalog_dirs = 0;
+    SD.remove(CATALOG_FILENAME);
+    if (SD.rename(CATALOG_NEW_FILENAME, CATALOG_FILENAME)) {
+        catalog_count = written;
+        catalog_dirs = dir_count;
+    } else {
+        Serial.print("Can't write to ");
+        Serial.println(CATALOG_FILENAME);
+    }
+    scan_reset();
+    return catalog_count;
+}
+
+// Use the catalog on the card if it's valid, and start refreshing it in the
+// background. Returns the number of GIFs in it, 0 if there's no catalog yet
+int catalog_open(const char* directory) {
+    CatalogHeader header;
+    File file = SD.open(CATALOG_FILENAME);
+
+    catalog_count = catalog_dirs = 0;
+    if (file) {
+        if (file.read((uint8_t*) &header, sizeof(header)) == sizeof(header)
+                && header.version == CATALOG_VERSION
+                && header.path_len == CATALOG_PATH_LEN
+                && file.size() == sizeof(header) + header.count * sizeof(CatalogEntry) + header.dir_count * sizeof(CatalogDir)) {
+            catalog_count = header.count;
+            catalog_dirs = header.dir_count;
+        }
+        file.close();
+    }
+    catalog_refresh(directory);
+    return catalog_count;
+}
+
+bool catalog_get(int index, CatalogEntry* entry) {
+    return catalog_read(index, entry, 1) == 1;
+}
+
+// Read up to n entries starting at index in one go. Returns how many were
+// read, or -1 on error
+int catalog_read(int index, CatalogEntry* entries, int n) {
+    int got;
+
+    if (index < 0 || index >= catalog_count)
+        return -1;
+    if (n > catalog_count - index)
+        n = catalog_count - index;
+    File file = SD.open(CATALOG_FILENAME);
+    if (!file)
+        return -1;
+    if (!file.seek(sizeof(CatalogHeader) + index * sizeof(CatalogEntry))) {
+        file.close();
+        return -1;
+    }
+    got = file.read((uint8_t*) entries, n * sizeof(CatalogEntry)) / sizeof(CatalogEntry);
+    file.close();
+    return got;
+}
+
+// Binary search the catalog for path. Returns its index or -1
+int catalog_find(const char* path) {
+    CatalogEntry entry;
+    int lo = 0, hi = catalog_count - 1, mid, cmp;
+
+    if (path == NULL || !path[0])
+        return -1;
+    File file = SD.open(CATALOG_FILENAME);
+    if (!file)
+        return -1;
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        file.seek(sizeof(CatalogHeader) + mid * sizeof(CatalogEntry));
+        if (file.read((uint8_t*) &entry, sizeof(entry)) != sizeof(entry))
+            break;
+        cmp = strcmp(path, entry.path);
+        if (cmp == 0) {
+            file.close();
+            return mid;
+        }
+        if (cmp < 0)
+            hi = mid - 1;
+        else
+            lo = mid + 1;
+    }
+    file.close();
+    return -1;
+}
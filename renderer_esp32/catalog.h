@@ -0,0 +1,49 @@
+#ifndef _CATALOG_H_
+#define _CATALOG_H_
+
+#include <SD.h>
+
+#define CATALOG_VERSION 3
+#define CATALOG_FILENAME "/gifs.idx"
+// Where a refreshed catalog is written before it replaces the old one
+#define CATALOG_NEW_FILENAME "/gifs.new"
+#define CATALOG_PATH_LEN 128
+// Where the SD library mounts the card. Directories are listed with the
+// POSIX calls there, which unlike openNextFile() don't open every file
+#define CATALOG_MOUNT "/sd"
+// Directory or catalog entries handled per catalog_scan_step()
+#define CATALOG_SCAN_BATCH 16
+
+// On-card index of the GIFs under a directory and all its subdirectories: a
+// header, fixed-size entries sorted by path, so any entry can be read with
+// one seek, then a record of each directory as it was scanned, so a refresh
+// can tell which ones changed. Changes are only tracked per directory, so
+// entries hold nothing but the path
+typedef struct {
+    uint16_t version;
+    uint16_t path_len;
+    uint32_t count;
+    uint32_t dir_count;
+} __attribute__ ((packed)) CatalogHeader;
+
+typedef struct {
+    char path[CATALOG_PATH_LEN];
+} __attribute__ ((packed)) CatalogEntry;
+
+typedef struct {
+    char path[CATALOG_PATH_LEN];
+    uint32_t mtime;
+    uint32_t entries;   // files and directories in it
+    uint32_t names;     // hash of their names
+} __attribute__ ((packed)) CatalogDir;
+
+int catalog_open(const char* directory);
+void catalog_refresh(const char* directory);
+bool catalog_scan_step();
+int catalog_poll();
+bool catalog_get(int index, CatalogEntry* entry);
+int catalog_read(int index, CatalogEntry* entries, int n);
+int catalog_find(const char* path);
+bool is_anim_file(const char* filename);
+
+#endif
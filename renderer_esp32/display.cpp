@@ -0,0 +1,137 @@
+#include <Arduino.h>
+#include <Adafruit_ST7735.h>
+#include "display.h"
+#include "gifdec.h"
+
+#define MIN(A, B) ((A) < (B) ? (A) : (B))
+#define MAX(A, B) ((A) > (B) ? (A) : (B))
+
+// Asynchronous, CPU-driven TFT transfers: they're queued to a task that owns
+// the TFT while they run, and the caller only blocks in display_wait(). They
+// aren't DMA. The TFT is drawn on through the Arduino SPI driver, by this and
+// by Adafruit_GFX for the menus, and the SD card shares its bus, and that
+// driver has no DMA API and can't share the peripheral with the IDF
+// spi_master driver that has one. See DISPLAY_PRIORITY for where the
+// transfers' CPU time comes from.
+
+static Adafruit_ST7735* tft;
+static TaskHandle_t task;
+static SemaphoreHandle_t done;
+static uint16_t* pending_pixels;
+static Rect pending_rect;
+static bool pending_big_endian;
+// pending_pixels holds just the rect, not a whole screen
+static bool pending_band;
+// Only touched by the submitting side: a transfer was queued and its
+// completion hasn't been collected from `done` yet
+static bool outstanding = false;
+// How long the last transfer took, written by the display task
+static uint32_t push_us = 0;
+
+
+// Grow a to also cover b
+void rect_union(Rect* a, const Rect* b) {
+    uint16_t x2, y2;
+
+    if (!b->w || !b->h)
+        return;
+    if (!a->w || !a->h) {
+        *a = *b;
+        return;
+    }
+    x2 = MAX(a->x + a->w, b->x + b->w);
+    y2 = MAX(a->y + a->h, b->y + b->h);
+    a->x = MIN(a->x, b->x);
+    a->y = MIN(a->y, b->y);
+    a->w = x2 - a->x;
+    a->h = y2 - a->y;
+}
+
+// Send the given area of a screen buffer to the TFT. Large areas go as one
+// full-screen transfer, full-width bands as one contiguous transfer, anything
+// else a row at a time. A band buffer holds only the area, so it always goes
+// as one transfer.
+static void push_rect(uint16_t* pixels, Rect* r, bool big_endian, bool band) {
+    if (!r->w || !r->h)
+        return;
+    if (!band && r->w * r->h >= FULL_PUSH_AREA)
+        *r = (Rect) {0, 0, SCREEN_W, SCREEN_H};
+
+    tft->startWrite();
+    tft->setAddrWindow(r->x, r->y, r->w, r->h);
+    if (band) {
+        tft->writePixels(pixels, r->w * r->h, true, big_endian);
+    } else if (r->w == SCREEN_W) {
+        tft->writePixels(pixels + r->y * SCREEN_W, r->w * r->h, true, big_endian);
+    } else {
+        for (uint16_t y = r->y; y < r->y + r->h; y++)
+            tft->writePixels(pixels + y * SCREEN_W + r->x, r->w, true, big_endian);
+    }
+    tft->endWrite();
+}
+
+static void display_task(void* arg) {
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        uint32_t start = micros();
+        push_rect(pending_pixels, &pending_rect, pending_big_endian, pending_band);
+        push_us = micros() - start;
+        xSemaphoreGive(done);
+    }
+}
+
+void display_begin(Adafruit_ST7735* display) {
+    tft = display;
+    // GIFs are decoded straight to the byte order the TFT takes, so
+    // frames go out without being swapped pixel by pixel
+    gd_set_colors(DISPLAY_GAMMA, DISPLAY_DIMMING, 1);
+    done = xSemaphoreCreateBinary();
+    xTaskCreatePinnedToCore(display_task, "display", DISPLAY_STACK, NULL, DISPLAY_PRIORITY, &task, DISPLAY_CORE);
+}
+
+// Queue rect of pixels for the TFT and return. big_endian says which byte
+// order the pixels are in. pixels must not be changed until display_idle()
+// or display_wait() says the transfer is done.
+void display_push(uint16_t* pixels, const Rect* rect, bool big_endian) {
+    display_wait();
+    pending_pixels = pixels;
+    pending_rect = *rect;
+    pending_big_endian = big_endian;
+    pending_band = false;
+    outstanding = true;
+    xTaskNotifyGive(task);
+}
+
+// Like display_push(), but pixels only hold rect, row after row, as the
+// decoder's bands do
+void display_push_band(uint16_t* pixels, const Rect* rect, bool big_endian) {
+    display_wait();
+    pending_pixels = pixels;
+    pending_rect = *rect;
+    pending_big_endian = big_endian;
+    pending_band = true;
+    outstanding = true;
+    xTaskNotifyGive(task);
+}
+
+// True if nothing is being sent. Doesn't block
+bool display_idle() {
+    if (outstanding && xSemaphoreTake(done, 0) == pdTRUE)
+        outstanding = false;
+    return !outstanding;
+}
+
+// Block until the last queued transfer is done. Must be called before
+// drawing on the TFT directly
+void display_wait() {
+    if (outstanding) {
+        xSemaphoreTake(done, portMAX_DELAY);
+        outstanding = false;
+    }
+}
+
+// Microseconds the last finished transfer took. Only valid once
+// display_idle() or display_wait() has seen it finish
+uint32_t display_push_us() {
+    return push_us;
+}
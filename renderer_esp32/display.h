@@ -0,0 +1,39 @@
+#ifndef _DISPLAY_H_
+#define _DISPLAY_H_
+
+#include <Adafruit_ST7735.h>
+
+#define SCREEN_W 128
+#define SCREEN_H 128
+// Changed area above which a whole-screen push is cheaper than a windowed one
+#define FULL_PUSH_AREA (SCREEN_W * SCREEN_H * 3 / 4)
+
+// Gamma applied to GIF colors on top of the panel's own curve, and software
+// dimming (255 = none, the backlight does the dimming)
+#define DISPLAY_GAMMA 1.0f
+#define DISPLAY_DIMMING 255
+
+// Display task placement. Transfers are CPU-driven, so they take some core's
+// time: core 0 is the decoder's, which is the bottleneck, and loop() on core
+// 1 mostly sleeps. Above loop()'s priority 1, a transfer runs as soon as it's
+// queued and through to the end, instead of being time-sliced against
+// loop()'s spin-waits, at the cost of loop() polling buttons up to one
+// transfer later
+#define DISPLAY_CORE 1
+#define DISPLAY_STACK 4096
+#define DISPLAY_PRIORITY 2
+
+typedef struct {
+    uint16_t x, y, w, h;
+} Rect;
+
+void rect_union(Rect* a, const Rect* b);
+
+void display_begin(Adafruit_ST7735* tft);
+void display_push(uint16_t* pixels, const Rect* rect, bool big_endian);
+void display_push_band(uint16_t* pixels, const Rect* rect, bool big_endian);
+bool display_idle();
+void display_wait();
+uint32_t display_push_us();
+
+#endif
@@ -10,66 +10,282 @@
 // #include <unistd.h>
 
 #include <SD.h>
+#include <math.h>
 
 #define MIN(A, B) ((A) < (B) ? (A) : (B))
 #define MAX(A, B) ((A) > (B) ? (A) : (B))
 
+/* There is only ever one image being decompressed at a time, so all gd_GIFs
+ * share a single statically allocated dictionary. Keeping it out of the
+ * heap keeps it in internal SRAM, and the packed entries make it 20 KB
+ * instead of the 24 KB an array of padded structs needs. */
+static gd_Table lzw_table;
+
+
+/* Buffered reader.
+ * All reads go through gif->buf so the SD library is only called once per
+ * GD_READ_BUF_SIZE bytes instead of once per field/byte. The file position
+ * is always buf_off + buf_len; the logical read position is buf_off + buf_pos. */
 
 static uint16_t
-read_num(File* fd)
+fill_buf(gd_GIF *gif)
+{
+    off_t next = gif->buf_off + gif->buf_len;
+    /* Read up to the next aligned boundary so later reads are sector-aligned. */
+    uint16_t want = GD_READ_BUF_SIZE - (next % GD_READ_BUF_SIZE);
+    int got = gif->fd->read(gif->buf, want);
+
+    gif->buf_off = next;
+    gif->buf_pos = 0;
+    gif->buf_len = got > 0 ? got : 0;
+    return gif->buf_len;
+}
+
+static inline uint8_t
+read_byte(gd_GIF *gif)
+{
+    if (gif->buf_pos == gif->buf_len && !fill_buf(gif))
+        return 0;
+    return gif->buf[gif->buf_pos++];
+}
+
+static void
+read_bytes(gd_GIF *gif, uint8_t *dest, int n)
 {
-    uint8_t bytes[2];
+    int chunk;
+
+    while (n > 0) {
+        if (gif->buf_pos == gif->buf_len && !fill_buf(gif)) {
+            memset(dest, 0, n);
+            return;
+        }
+        chunk = MIN(n, gif->buf_len - gif->buf_pos);
+        memcpy(dest, &gif->buf[gif->buf_pos], chunk);
+        gif->buf_pos += chunk;
+        dest += chunk;
+        n -= chunk;
+    }
+}
 
-    fd->read(bytes, 2);
-    return bytes[0] + (((uint16_t) bytes[1]) << 8);
+static inline off_t
+tell(gd_GIF *gif)
+{
+    return gif->buf_off + gif->buf_pos;
+}
+
+static void
+seek_to(gd_GIF *gif, off_t pos)
+{
+    if (pos >= gif->buf_off && pos <= gif->buf_off + gif->buf_len) {
+        gif->buf_pos = pos - gif->buf_off;
+        return;
+    }
+    gif->fd->seek(pos, SeekSet);
+    gif->buf_off = pos;
+    gif->buf_pos = gif->buf_len = 0;
+}
+
+static inline void
+skip_bytes(gd_GIF *gif, int n)
+{
+    seek_to(gif, tell(gif) + n);
+}
+
+/* Drop the read-ahead and move the file to the logical position, so user
+ * callbacks can read from gif->fd directly. Return that position. */
+static off_t
+sync_fd(gd_GIF *gif)
+{
+    off_t pos = tell(gif);
+
+    gif->fd->seek(pos, SeekSet);
+    gif->buf_off = pos;
+    gif->buf_pos = gif->buf_len = 0;
+    return pos;
 }
 
 static uint16_t
-color565(gd_RGBColor c)
+read_num(gd_GIF *gif)
 {
-    return ((c.r & 0xF8) << 8) | ((c.g & 0xFC) << 3) | ((c.b & 0xF8) >> 3);
+    uint8_t lo = read_byte(gif);
+
+    return lo + (((uint16_t) read_byte(gif)) << 8);
+}
+
+/* Palette conversion.
+ * Each channel goes through a lookup table that already holds its RGB565
+ * bits, with gamma and software dimming folded in, so a color is three
+ * lookups and two ORs. There's a set of tables per byte order. */
+static uint16_t lut_r[2][256], lut_g[2][256], lut_b[2][256];
+static uint8_t lut_ready, default_big_endian;
+
+/* Palettes are read here rather than into a heap buffer. */
+static gd_RGBColor palette_rgb[256];
+
+/* The last local color table converted. Frames that declare the same one
+ * again keep the colors already in gif->lct. */
+static struct {
+    gd_Palette *dest;
+    int size;
+    gd_RGBColor rgb[256];
+} last_lct;
+
+static uint16_t
+color565(gd_RGBColor c, int big_endian)
+{
+    return lut_r[big_endian][c.r] | lut_g[big_endian][c.g] | lut_b[big_endian][c.b];
+}
+
+/* Set up palette conversion: channel values are raised to gamma and scaled
+ * by brightness/255. GIFs opened afterwards get big_endian as their byte
+ * order. Only affects palettes read afterwards. */
+void
+gd_set_colors(float gamma, uint8_t brightness, int big_endian)
+{
+    int v;
+    uint8_t x;
+    uint16_t r, g, b;
+
+    for (v = 0; v < 256; v++) {
+        x = powf(v / 255.0f, gamma) * brightness + 0.5f;
+        r = (x & 0xF8) << 8;
+        g = (x & 0xFC) << 3;
+        b = x >> 3;
+        lut_r[0][v] = r;
+        lut_g[0][v] = g;
+        lut_b[0][v] = b;
+        lut_r[1][v] = (r >> 8) | (r << 8);
+        lut_g[1][v] = (g >> 8) | (g << 8);
+        lut_b[1][v] = (b >> 8) | (b << 8);
+    }
+    lut_ready = 1;
+    default_big_endian = !!big_endian;
+    last_lct.dest = NULL;
 }
 
 static void
-read_palette(File* fd, gd_Palette* dest, int num_colors)
+read_palette(gd_GIF *gif, gd_Palette* dest, int num_colors)
 {
     int bsize = sizeof(gd_RGBColor) * num_colors;
-    gd_RGBColor* buffer = (gd_RGBColor*) malloc(bsize);
-    fd->read((uint8_t*) buffer, bsize);
+
+    read_bytes(gif, (uint8_t*) palette_rgb, bsize);
+    if (dest == &gif->lct) {
+        if (last_lct.dest == dest && last_lct.size == num_colors && !memcmp(last_lct.rgb, palette_rgb, bsize))
+            return;
+        last_lct.dest = dest;
+        last_lct.size = num_colors;
+        memcpy(last_lct.rgb, palette_rgb, bsize);
+    }
     dest->size = num_colors;
     for (int i = 0; i < num_colors; i++) {
-        dest->colors[i] = color565(buffer[i]);
+        dest->colors[i] = color565(palette_rgb[i], gif->big_endian);
     }
-    free(buffer);
     // Serial.println("read palette");
 }
 
+/* Nearest-neighbour mapping of a source axis of length len onto an output
+ * axis of length out, at scale (16.16 fixed point, output per source), with
+ * the image centered. Arrays are filled in as described in gd_Axis. Return
+ * the canvas length: how many source pixels are kept. */
+static uint16_t
+build_axis(gd_Axis *a, uint16_t len, uint16_t out, uint32_t scale)
+{
+    int64_t size, off, o;
+    uint32_t step, src;
+    int32_t prev = -1;
+    uint16_t n = 0;
+    int s;
+
+    /* Rounded, as scale itself was rounded down. */
+    size = ((uint64_t) len * scale + 0x8000) >> 16;
+    if (size < 1)
+        size = 1;
+    off = ((int64_t) out - size) / 2;
+    a->start = MAX(off, 0);
+    a->end = MIN(off + size, (int64_t) out);
+    /* Source pixels per output pixel. */
+    step = ((uint64_t) len << 16) / size;
+    for (s = 0; s < len; s++)
+        a->keep[s] = -1;
+    for (o = a->start; o < a->end; o++) {
+        src = ((uint64_t) (o - off) * step) >> 16;
+        if ((int32_t) src != prev) {
+            a->source[n] = src;
+            a->keep[src] = n++;
+            prev = src;
+        }
+        a->show[o] = n - 1;
+    }
+    a->first[len] = n;
+    for (s = len - 1; s >= 0; s--)
+        a->first[s] = a->keep[s] >= 0 ? a->keep[s] : a->first[s + 1];
+    a->shown_at[n] = a->end;
+    for (o = a->end - 1; o >= a->start; o--)
+        a->shown_at[a->show[o]] = o;
+    return n;
+}
+
+/* Carve an axis' arrays out of mem; return the memory after them. */
+static uint8_t *
+alloc_axis(gd_Axis *a, uint8_t *mem, uint16_t len, uint16_t out)
+{
+    a->keep = (int16_t *) mem;
+    a->first = (uint16_t *) &a->keep[len];
+    a->show = &a->first[len + 1];
+    a->shown_at = &a->show[out];
+    a->source = &a->shown_at[MIN(len, out) + 1];
+    return (uint8_t *) &a->source[MIN(len, out)];
+}
+
+#define AXIS_SIZE(len, out) \
+    (((len) + (len) + 1 + (out) + 2 * MIN(len, out) + 1) * sizeof(uint16_t))
+
 gd_GIF *
 gd_open_gif(File* fd)
 {
-    uint8_t sigver[3];
+    return gd_open_gif_scaled(fd, 0, 0, GD_SCALE_FIT);
+}
+
+/* Open a GIF that gd_render_frame() renders at out_w x out_h, scaled to fit
+ * or fill it (see GD_SCALE_*). An output size of 0 x 0 means the GIF's own
+ * size. When the image is shrunk the canvas is too, so large GIFs never
+ * need a canvas of their full size. With GD_STREAM there's no canvas at
+ * all, only GD_BAND_ROWS rows of output. */
+gd_GIF *
+gd_open_gif_scaled(File* fd, uint16_t out_w, uint16_t out_h, int mode)
+{
+    uint8_t header[13];
     uint16_t width, height, depth;
-    uint8_t fdsz, bgidx, aspect;
+    uint8_t fdsz, bgidx;
+    uint32_t sx, sy, band_size;
+    uint8_t *mem;
     int gct_sz;
-    gd_GIF *gif;
+    gd_GIF *gif = NULL;
 
+    /* Signature, version, logical screen descriptor in one read. */
+    if (fd->read(header, sizeof(header)) != sizeof(header)) {
+        Serial.println("short header");
+        goto fail;
+    }
     /* Header */
-    fd->read(sigver, 3);
-    if (memcmp(sigver, "GIF", 3) != 0) {
+    if (memcmp(header, "GIF", 3) != 0) {
         Serial.println("invalid signature");
         goto fail;
     }
     /* Version */
-    fd->read(sigver, 3);
-    if (memcmp(sigver, "89a", 3) != 0) {
+    if (memcmp(&header[3], "89a", 3) != 0) {
         Serial.println("invalid version");
         goto fail;
     }
     /* Width x Height */
-    width  = read_num(fd);
-    height = read_num(fd);
+    width  = header[6] + (((uint16_t) header[7]) << 8);
+    height = header[8] + (((uint16_t) header[9]) << 8);
+    if (!width || !height) {
+        Serial.println("empty logical screen");
+        goto fail;
+    }
     /* FDSZ */
-    fd->read(&fdsz, 1);
+    fdsz = header[10];
     /* Presence of GCT */
     if (!(fdsz & 0x80)) {
         Serial.println("no global color table");
@@ -81,30 +297,58 @@ gd_open_gif(File* fd)
     /* GCT Size */
     gct_sz = 1 << ((fdsz & 0x07) + 1);
     /* Background Color Index */
-    fd->read(&bgidx, 1);
-    /* Aspect Ratio */
-    fd->read(&aspect, 1);
+    bgidx = header[11];
+    /* Ignore Aspect Ratio (header[12]). */
+    if (!out_w || !out_h) {
+        out_w = width;
+        out_h = height;
+    }
+    band_size = mode & GD_STREAM ? out_w * GD_BAND_ROWS : 0;
     /* Create gd_GIF Structure. */
-    gif = (gd_GIF*) calloc(1, sizeof(*gif) + 3 * width * height);
+    gif = (gd_GIF*) calloc(1, sizeof(*gif) + height * sizeof(uint32_t)
+                              + AXIS_SIZE(width, out_w) + AXIS_SIZE(height, out_h)
+                              + (band_size ? 2 * band_size * sizeof(uint16_t) + width : 0));
     if (!gif) goto fail;
+    gif->rows = (uint32_t *) &gif[1];
+    mem = alloc_axis(&gif->ax, (uint8_t *) &gif->rows[height], width, out_w);
+    mem = alloc_axis(&gif->ay, mem, height, out_h);
+    if (band_size) {
+        gif->bands[0] = (uint16_t *) mem;
+        gif->bands[1] = &gif->bands[0][band_size];
+        gif->line = (uint8_t *) &gif->bands[1][band_size];
+    }
+    sx = ((uint32_t) out_w << 16) / width;
+    sy = ((uint32_t) out_h << 16) / height;
+    sx = (mode & GD_SCALE_MASK) == GD_SCALE_FILL ? MAX(sx, sy) : MIN(sx, sy);
+    gif->canvas_w = build_axis(&gif->ax, width, out_w, sx);
+    gif->canvas_h = build_axis(&gif->ay, height, out_h, sx);
+    gif->decimate = gif->canvas_w != width || gif->canvas_h != height;
+    gif->out_w = out_w;
+    gif->out_h = out_h;
+    if (!gif->line) {
+        gif->canvas = (uint16_t *) calloc(gif->canvas_w * gif->canvas_h, sizeof(uint16_t));
+        if (!gif->canvas) goto fail;
+    }
     gif->fd = fd;
+    gif->buf_off = sizeof(header);
     gif->width  = width;
     gif->height = height;
     gif->depth  = depth;
+    if (!lut_ready)
+        gd_set_colors(1.0f, 255, 0);
+    gif->big_endian = default_big_endian;
     /* Read GCT */
-    read_palette(fd, &gif->gct, gct_sz);
+    read_palette(gif, &gif->gct, gct_sz);
     gif->palette = &gif->gct;
     gif->bgindex = bgidx;
-    gif->canvas = (uint16_t *) &gif[1];
-    gif->frame = (uint8_t*) &gif->canvas[2 * width * height];
-    if (gif->bgindex)
-        memset(gif->frame, gif->bgindex, gif->width * gif->height);
-    gif->anim_start = fd->position();
-    gif->table = new_table();
+    gif->anim_start = tell(gif);
+    gif->table = &lzw_table;
     return gif;
 fail:
-    if (gif)
+    if (gif) {
+        free(gif->canvas);
         free(gif);
+    }
     return NULL;
 }
 
@@ -114,8 +358,8 @@ discard_sub_blocks(gd_GIF *gif)
     uint8_t size;
 
     do {
-        gif->fd->read(&size, 1);
-        gif->fd->seek(size, SeekCur);
+        size = read_byte(gif);
+        skip_bytes(gif, size);
     } while (size);
 }
 
@@ -126,21 +370,21 @@ read_plain_text_ext(gd_GIF *gif)
         uint16_t tx, ty, tw, th;
         uint8_t cw, ch, fg, bg;
         off_t sub_block;
-        gif->fd->seek(1, SeekCur); /* block size = 12 */
-        tx = read_num(gif->fd);
-        ty = read_num(gif->fd);
-        tw = read_num(gif->fd);
-        th = read_num(gif->fd);
-        gif->fd->read(&cw, 1);
-        gif->fd->read(&ch, 1);
-        gif->fd->read(&fg, 1);
-        gif->fd->read(&bg, 1);
-        sub_block = gif->fd->seek(0, SeekCur);
+        skip_bytes(gif, 1); /* block size = 12 */
+        tx = read_num(gif);
+        ty = read_num(gif);
+        tw = read_num(gif);
+        th = read_num(gif);
+        cw = read_byte(gif);
+        ch = read_byte(gif);
+        fg = read_byte(gif);
+        bg = read_byte(gif);
+        sub_block = sync_fd(gif);
         gif->plain_text(gif, tx, ty, tw, th, cw, ch, fg, bg);
-        gif->fd->seek(sub_block, SeekSet);
+        seek_to(gif, sub_block);
     } else {
         /* Discard plain text metadata. */
-        gif->fd->seek(13, SeekCur);
+        skip_bytes(gif, 13);
     }
     /* Discard plain text sub-blocks. */
     discard_sub_blocks(gif);
@@ -152,24 +396,24 @@ read_graphic_control_ext(gd_GIF *gif)
     uint8_t rdit;
 
     /* Discard block size (always 0x04). */
-    gif->fd->seek(1, SeekCur);
-    gif->fd->read(&rdit, 1);
+    skip_bytes(gif, 1);
+    rdit = read_byte(gif);
     gif->gce.disposal = (rdit >> 2) & 3;
     gif->gce.input = rdit & 2;
     gif->gce.transparency = rdit & 1;
-    gif->gce.delay = read_num(gif->fd);
-    gif->fd->read(&gif->gce.tindex, 1);
+    gif->gce.delay = read_num(gif);
+    gif->gce.tindex = read_byte(gif);
     /* Skip block terminator. */
-    gif->fd->seek(1, SeekCur);
+    skip_bytes(gif, 1);
 }
 
 static void
 read_comment_ext(gd_GIF *gif)
 {
     if (gif->comment) {
-        off_t sub_block = gif->fd->seek(0, SeekCur);
+        off_t sub_block = sync_fd(gif);
         gif->comment(gif);
-        gif->fd->seek(sub_block, SeekSet);
+        seek_to(gif, sub_block);
     }
     /* Discard comment sub-blocks. */
     discard_sub_blocks(gif);
@@ -182,21 +426,21 @@ read_application_ext(gd_GIF *gif)
     char app_auth_code[3];
 
     /* Discard block size (always 0x0B). */
-    gif->fd->seek(1, SeekCur);
+    skip_bytes(gif, 1);
     /* Application Identifier. */
-    gif->fd->read((uint8_t*) app_id, 8);
+    read_bytes(gif, (uint8_t*) app_id, 8);
     /* Application Authentication Code. */
-    gif->fd->read((uint8_t*) app_auth_code, 3);
+    read_bytes(gif, (uint8_t*) app_auth_code, 3);
     if (!strncmp(app_id, "NETSCAPE", sizeof(app_id))) {
         /* Discard block size (0x03) and constant byte (0x01). */
-        gif->fd->seek(2, SeekCur);
-        gif->loop_count = read_num(gif->fd);
+        skip_bytes(gif, 2);
+        gif->loop_count = read_num(gif);
         /* Skip block terminator. */
-        gif->fd->seek(1, SeekCur);
+        skip_bytes(gif, 1);
     } else if (gif->application) {
-        off_t sub_block = gif->fd->seek(0, SeekCur);
+        off_t sub_block = sync_fd(gif);
         gif->application(gif, app_id, app_auth_code);
-        gif->fd->seek(sub_block, SeekSet);
+        seek_to(gif, sub_block);
         discard_sub_blocks(gif);
     } else {
         discard_sub_blocks(gif);
@@ -208,7 +452,7 @@ read_ext(gd_GIF *gif)
 {
     uint8_t label;
 
-    gif->fd->read(&label, 1);
+    label = read_byte(gif);
     switch (label) {
     case 0x01:
         read_plain_text_ext(gif);
@@ -228,103 +472,386 @@ read_ext(gd_GIF *gif)
     }
 }
 
-static gd_Table *
-new_table()
-{
-    // int key;
-    // int init_bulk = MAX(1 << (key_size + 1), 0x100);
-    // Table *table = (Table*) malloc(sizeof(*table) + sizeof(Entry) * init_bulk);
-    // if (table) {
-    //     table->bulk = init_bulk;
-    //     table->nentries = (1 << key_size) + 2;
-    //     table->entries = (Entry *) &table[1];
-    //     for (key = 0; key < (1 << key_size); key++)
-    //         table->entries[key] = (Entry) {1, 0xFFF, key};
-    // }
-    // return table;
-    gd_Table* table = (gd_Table*) malloc(sizeof(gd_Table) + (sizeof(gd_Entry) * 4096));
-    table->entries = (gd_Entry*) &table[1];
-    return table;
-}
-
 static void
 reset_table(gd_Table* table, int key_size)
 {
     table->nentries = (1 << key_size) + 2;
     for (int key = 0; key < (1 << key_size); key++) {
-        table->entries[key] = (gd_Entry) {1, 0xFFF, key};
+        table->entries[key] = GD_ENTRY(1, 0xFFF, key);
+        table->first[key] = key;
     }
 }
 
 /* Add table entry. Return value:
  *  0 on success
- *  +1 if key size must be incremented after this addition
- *  -1 if could not realloc table */
+ *  +1 if key size must be incremented after this addition */
 static int
 add_entry(gd_Table* table, uint16_t length, uint16_t prefix, uint8_t suffix)
 {
-    // Table *table = *tablep;
-    // if (table->nentries == table->bulk) {
-    //     table->bulk *= 2;
-    //     table = (Table*) realloc(table, sizeof(*table) + sizeof(Entry) * table->bulk);
-    //     if (!table) return -1;
-    //     table->entries = (Entry *) &table[1];
-    //     *tablep = table;
-    // }
-    table->entries[table->nentries] = (gd_Entry) {length, prefix, suffix};
+    table->entries[table->nentries] = GD_ENTRY(length, prefix, suffix);
+    table->first[table->nentries] = table->first[prefix];
     table->nentries++;
     if ((table->nentries & (table->nentries - 1)) == 0)
         return 1;
     return 0;
 }
 
-static uint16_t
-get_key(gd_GIF *gif, int key_size, uint8_t *sub_len, uint8_t *shift, uint8_t *byte)
+/* LZW bit reservoir. Codes are taken from the low end of `bits`; whole
+ * bytes are shifted in above them from the current data sub-block. */
+typedef struct gd_Bits {
+    uint32_t bits;
+    int nbits;
+    uint8_t sub_len;
+    uint8_t done; /* block terminator has been consumed */
+} gd_Bits;
+
+static void
+fill_bits(gd_GIF *gif, gd_Bits *br)
+{
+    while (br->nbits <= 24) {
+        if (br->sub_len == 0) {
+            br->sub_len = read_byte(gif);
+            if (br->sub_len == 0) {
+                br->done = 1;
+                return;
+            }
+        }
+        br->bits |= ((uint32_t) read_byte(gif)) << br->nbits;
+        br->nbits += 8;
+        br->sub_len--;
+    }
+}
+
+/* Return next key, or 0xFFFF if the image data ran out before a stop code. */
+static inline uint16_t
+get_key(gd_GIF *gif, gd_Bits *br, int key_size)
 {
-    int bits_read;
-    int rpad;
-    int frag_size;
     uint16_t key;
 
-    key = 0;
-    for (bits_read = 0; bits_read < key_size; bits_read += frag_size) {
-        rpad = (*shift + bits_read) % 8;
-        if (rpad == 0) {
-            /* Update byte. */
-            if (*sub_len == 0)
-                gif->fd->read(sub_len, 1); /* Must be nonzero! */
-            gif->fd->read(byte, 1);
-            (*sub_len)--;
-        }
-        frag_size = MIN(key_size - bits_read, 8 - rpad);
-        key |= ((uint16_t) ((*byte) >> rpad)) << bits_read;
+    if (br->nbits < key_size) {
+        if (!br->done)
+            fill_bits(gif, br);
+        if (br->nbits < key_size)
+            return 0xFFFF;
     }
-    /* Clear extra bits to the left. */
-    key &= (1 << key_size) - 1;
-    *shift = (*shift + key_size) % 8;
+    key = br->bits & ((1 << key_size) - 1);
+    br->bits >>= key_size;
+    br->nbits -= key_size;
     return key;
 }
 
-/* Compute output index of y-th input line, in frame of height h. */
-static int
-interlaced_line_index(int h, int y)
-{
-    int p; /* number of lines in current pass */
-
-    p = (h - 1) / 8 + 1;
-    if (y < p) /* pass 1 */
-        return y * 8;
-    y -= p;
-    p = (h - 5) / 8 + 1;
-    if (y < p) /* pass 2 */
-        return y * 8 + 4;
-    y -= p;
-    p = (h - 3) / 4 + 1;
-    if (y < p) /* pass 3 */
-        return y * 4 + 2;
-    y -= p;
-    /* pass 4 */
-    return y * 2 + 1;
+/* Row offset for lines the canvas doesn't keep. */
+#define GD_NO_ROW 0xFFFFFFFF
+
+/* Canvas offset of the start of line of the current image: of its first
+ * pixel, or of the canvas row when decimating, where each pixel's column
+ * is looked up separately. */
+static inline uint32_t
+canvas_row(gd_GIF *gif, int line)
+{
+    int16_t row = gif->ay.keep[gif->fy + line];
+
+    if (row < 0)
+        return GD_NO_ROW;
+    return (uint32_t) row * gif->canvas_w + (gif->decimate ? 0 : gif->fx);
+}
+
+/* First line and line step of each pass of an interlaced image. */
+static const uint8_t pass_start[4] = {0, 4, 2, 1};
+static const uint8_t pass_step[4]  = {8, 8, 4, 2};
+
+/* Set gif->rows[y] to the canvas pixel offset of the line
+ * that the y-th decoded line of the current image goes to, so the decoder
+ * never has to divide. When streaming, there's no canvas, and it's the
+ * line itself. */
+static void
+build_rows(gd_GIF *gif, int interlace)
+{
+    int pass, line, y;
+
+    if (!interlace) {
+        for (y = 0; y < gif->fh; y++)
+            gif->rows[y] = gif->line ? y : canvas_row(gif, y);
+        return;
+    }
+    y = 0;
+    for (pass = 0; pass < 4; pass++)
+        for (line = pass_start[pass]; line < gif->fh; line += pass_step[pass])
+            gif->rows[y++] = gif->line ? line : canvas_row(gif, line);
+}
+
+/* What gif->rows[y] would be for the y-th decoded line of a frame that
+ * sticks out of the logical screen, which has more lines than gif->rows
+ * has room for, or GD_NO_ROW if that line is cut off. */
+static uint32_t
+clipped_row(gd_GIF *gif, int y, int interlace)
+{
+    int pass, n, line = gif->ih;
+
+    if (!interlace) {
+        line = y;
+    } else {
+        for (pass = 0; pass < 4; pass++) {
+            n = gif->ih > pass_start[pass]
+                ? (gif->ih - pass_start[pass] + pass_step[pass] - 1) / pass_step[pass] : 0;
+            if (y < n) {
+                line = pass_start[pass] + y * pass_step[pass];
+                break;
+            }
+            y -= n;
+        }
+    }
+    if (line >= gif->fh)
+        return GD_NO_ROW;
+    return gif->line ? line : canvas_row(gif, line);
+}
+
+/* Store one decoded pixel at canvas offset off, unless it is transparent
+ * (tindex is -1 when the frame has no transparency). */
+static inline void
+put_pixel(gd_GIF *gif, uint32_t off, uint8_t index, int tindex)
+{
+    if (index != tindex)
+        gif->canvas[off] = gif->palette->colors[index];
+}
+
+/* A string unpacked front to back, for the paths that can't write it
+ * straight to the canvas. */
+static uint8_t str_buf[4096];
+
+static void
+unpack_string(gd_GIF *gif, gd_Entry entry, int str_len)
+{
+    gd_Entry *entries = gif->table->entries;
+    int i;
+
+    for (i = str_len - 1; ; i--) {
+        str_buf[i] = GD_ENTRY_SUFFIX(entry);
+        if (!i)
+            break;
+        entry = entries[GD_ENTRY_PREFIX(entry)];
+    }
+}
+
+/* Store the first n pixels of a string of str_len starting at (*x, *y) of
+ * the current image, keeping only those the canvas keeps, and advance
+ * (*x, *y) past them. Used instead of the direct writes below when the
+ * canvas is decimated. */
+static void
+put_decimated(gd_GIF *gif, gd_Entry entry, int str_len, int n,
+              int *x, int *y, int tindex)
+{
+    const int16_t *keep = &gif->ax.keep[gif->fx];
+    uint32_t row = gif->rows[*y];
+    int i;
+
+    /* A dropped line needs no pixels, just moving past. */
+    if (row == GD_NO_ROW && *x + n < gif->fw) {
+        *x += n;
+        return;
+    }
+    unpack_string(gif, entry, str_len);
+    for (i = 0; i < n; i++) {
+        if (row != GD_NO_ROW && keep[*x] >= 0 && str_buf[i] != tindex)
+            gif->canvas[row + keep[*x]] = gif->palette->colors[str_buf[i]];
+        if (++*x == gif->fw) {
+            *x = 0;
+            if (++*y < gif->fh)
+                row = gif->rows[*y];
+        }
+    }
+}
+
+/* Send what's gathered in the current band, if anything, and switch to
+ * the other band buffer, leaving this one alone while it's sent. */
+static void
+flush_band(gd_GIF *gif)
+{
+    if (!gif->band_h)
+        return;
+    if (gif->band)
+        gif->band(gif, gif->band_x, gif->band_y, gif->band_w, gif->band_h,
+                  gif->bands[gif->cur_band]);
+    gif->cur_band ^= 1;
+    gif->band_h = 0;
+}
+
+/* Output row of the band being gathered that output row y, x..x+w-1, goes
+ * to. Sends the band first if y doesn't carry it on. */
+static uint16_t *
+band_row(gd_GIF *gif, uint16_t x, uint16_t y, uint16_t w)
+{
+    if (gif->band_h && (gif->band_h == GD_BAND_ROWS || x != gif->band_x
+                        || w != gif->band_w || y != gif->band_y + gif->band_h))
+        flush_band(gif);
+    if (!gif->band_h) {
+        gif->band_x = x;
+        gif->band_y = y;
+        gif->band_w = w;
+    }
+    return &gif->bands[gif->cur_band][gif->band_h++ * w];
+}
+
+/* Line of the current frame has been decoded into gif->line: scale it to
+ * the output rows showing it. Opaque rows are gathered into bands; rows
+ * with transparent pixels are sent right away as runs of opaque ones. */
+static void
+stream_line(gd_GIF *gif, int line, int tindex)
+{
+    const gd_Axis *ax = &gif->ax, *ay = &gif->ay;
+    uint16_t *colors = gif->palette->colors;
+    uint16_t *dst;
+    uint16_t cx0, cx1, x0, w, oy;
+    int16_t cy = ay->keep[gif->fy + line];
+    uint8_t index;
+    int i, run, sent;
+
+    if (cy < 0)
+        return;
+    cx0 = ax->first[gif->fx];
+    cx1 = ax->first[gif->fx + gif->fw];
+    if (cx0 == cx1)
+        return;
+    x0 = ax->shown_at[cx0];
+    w = ax->shown_at[cx1] - x0;
+    for (oy = ay->shown_at[cy]; oy < ay->shown_at[cy + 1]; oy++) {
+        if (tindex < 0) {
+            dst = band_row(gif, x0, oy, w);
+            for (i = 0; i < w; i++)
+                dst[i] = colors[gif->line[ax->source[ax->show[x0 + i]] - gif->fx]];
+            continue;
+        }
+        flush_band(gif);
+        dst = gif->bands[gif->cur_band];
+        run = -1;
+        sent = 0;
+        for (i = 0; i <= w; i++) {
+            index = i < w ? gif->line[ax->source[ax->show[x0 + i]] - gif->fx] : tindex;
+            if (index != tindex) {
+                dst[i] = colors[index];
+                if (run < 0)
+                    run = i;
+            } else if (run >= 0) {
+                if (gif->band)
+                    gif->band(gif, x0 + run, oy, i - run, 1, &dst[run]);
+                run = -1;
+                sent = 1;
+            }
+        }
+        /* Only a buffer something was sent from has to be left alone. */
+        if (sent)
+            gif->cur_band ^= 1;
+    }
+}
+
+/* Streaming counterpart of put_decimated(): gather the first n pixels of
+ * the string into gif->line, streaming each line as it's completed. */
+static void
+put_streamed(gd_GIF *gif, gd_Entry entry, int str_len, int n,
+             int *x, int *y, int tindex)
+{
+    int i = 0, k;
+
+    unpack_string(gif, entry, str_len);
+    while (i < n) {
+        k = MIN(n - i, gif->fw - *x);
+        memcpy(&gif->line[*x], &str_buf[i], k);
+        i += k;
+        *x += k;
+        if (*x == gif->fw) {
+            stream_line(gif, gif->rows[*y], tindex);
+            *x = 0;
+            ++*y;
+        }
+    }
+}
+
+/* Store the first n pixels of a string of str_len starting at (*x, *y) of
+ * the image data of a frame that sticks out of the logical screen, where
+ * lines are gif->iw long, and advance (*x, *y) past them. Pixels outside
+ * fw x fh are dropped. Such frames are rare, so this goes a pixel at a
+ * time, for every kind of output. */
+static void
+put_clipped(gd_GIF *gif, gd_Entry entry, int str_len, int n,
+            int *x, int *y, int tindex, int interlace)
+{
+    const int16_t *keep = &gif->ax.keep[gif->fx];
+    uint32_t row = clipped_row(gif, *y, interlace);
+    int i, col;
+
+    unpack_string(gif, entry, str_len);
+    for (i = 0; i < n; i++) {
+        if (row != GD_NO_ROW && *x < gif->fw) {
+            col = gif->decimate ? keep[*x] : *x;
+            if (gif->line)
+                gif->line[*x] = str_buf[i];
+            else if (col >= 0 && str_buf[i] != tindex)
+                gif->canvas[row + col] = gif->palette->colors[str_buf[i]];
+        }
+        if (++*x == gif->iw) {
+            if (gif->line && row != GD_NO_ROW)
+                stream_line(gif, row, tindex);
+            *x = 0;
+            if (++*y < gif->ih)
+                row = clipped_row(gif, *y, interlace);
+        }
+    }
+}
+
+/* Fill an area of the output with color, through band(). */
+static void
+stream_fill(gd_GIF *gif, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t color)
+{
+    uint16_t *dst;
+    int i;
+
+    for (; h; h--, y++) {
+        dst = band_row(gif, x, y, w);
+        for (i = 0; i < w; i++)
+            dst[i] = color;
+    }
+    flush_band(gif);
+}
+
+/* Write a string whose last pixel goes just before end, back to front, as
+ * strings are stored. Opaque strings store pixel pairs as one aligned 32-bit
+ * word once end is on a 4-byte boundary; the pair packing assumes a
+ * little-endian CPU, which the ESP32 is. */
+static inline void
+put_run_opaque(uint16_t *end, gd_Entry entry, const gd_Entry *entries, const uint16_t *colors)
+{
+    uint32_t hi;
+
+    if ((uintptr_t) end & 2) {
+        *--end = colors[GD_ENTRY_SUFFIX(entry)];
+        if (GD_ENTRY_PREFIX(entry) == 0xFFF)
+            return;
+        entry = entries[GD_ENTRY_PREFIX(entry)];
+    }
+    while (GD_ENTRY_PREFIX(entry) != 0xFFF) {
+        hi = colors[GD_ENTRY_SUFFIX(entry)];
+        entry = entries[GD_ENTRY_PREFIX(entry)];
+        end -= 2;
+        *(uint32_t *) end = colors[GD_ENTRY_SUFFIX(entry)] | (hi << 16);
+        if (GD_ENTRY_PREFIX(entry) == 0xFFF)
+            return;
+        entry = entries[GD_ENTRY_PREFIX(entry)];
+    }
+    *--end = colors[GD_ENTRY_SUFFIX(entry)];
+}
+
+/* Same for frames with transparency, which test every index. */
+static inline void
+put_run_keyed(uint16_t *end, gd_Entry entry, const gd_Entry *entries, const uint16_t *colors, int tindex)
+{
+    while (1) {
+        --end;
+        if ((int) GD_ENTRY_SUFFIX(entry) != tindex)
+            *end = colors[GD_ENTRY_SUFFIX(entry)];
+        if (GD_ENTRY_PREFIX(entry) == 0xFFF)
+            break;
+        entry = entries[GD_ENTRY_PREFIX(entry)];
+    }
 }
 
 /* Decompress image pixels.
@@ -332,48 +859,59 @@ interlaced_line_index(int h, int y)
 static int
 read_image_data(gd_GIF *gif, int interlace)
 {
-    uint8_t sub_len, shift, byte;
-    int init_key_size, key_size, table_is_full;
-    int frm_off, str_len, p, x, y;
+    gd_Bits br;
+    uint8_t byte;
+    uint16_t *p16, *colors;
+    uint32_t row, off;
+    int init_key_size, key_size, table_is_full, added, clipped;
+    int str_len, n, x, y, cx, cy, left, tindex, run_end;
     uint16_t key, clear, stop;
     int ret;
-    gd_Entry entry;
-    off_t start, end;
+    gd_Entry entry, *entries;
 
     // Serial.println("Read key size");
-    gif->fd->read(&byte, 1);
+    byte = read_byte(gif);
     key_size = (int) byte;
-    // Serial.println("Set pos, discard sub blocks");
-    // start = gif->fd->position();
-    // discard_sub_blocks(gif);
-    // end = gif->fd->position();
-    // gif->fd->seek(start, SeekSet);
     clear = 1 << key_size;
     stop = clear + 1;
     // Serial.println("New LZW table");
-    // table = new_table(key_size);
     reset_table(gif->table, key_size);
+    entries = gif->table->entries;
     key_size++;
     init_key_size = key_size;
-    sub_len = shift = 0;
-    // Serial.println("Get init key");
-    key = get_key(gif, key_size, &sub_len, &shift, &byte); /* clear code */
-    frm_off = 0;
+    build_rows(gif, interlace);
+    row = gif->fh ? gif->rows[0] : 0;
+    colors = gif->palette->colors;
+    tindex = gif->gce.transparency ? gif->gce.tindex : -1;
+    x = y = 0;
+    clipped = gif->fw != gif->iw || gif->fh != gif->ih;
+    left = clipped ? (int) MIN((uint32_t) gif->iw * gif->ih, INT32_MAX) : gif->fw * gif->fh;
+    /* The kernel is picked once per frame (see put_run_opaque() and
+     * put_run_keyed()). Without interlacing, a full-width frame's rows
+     * follow one another in the canvas, so strings that wrap rows still
+     * land in one run; otherwise a run ends with the row. */
+    run_end = !interlace && gif->fw == gif->canvas_w ? left : gif->fw;
+    memset(&br, 0, sizeof(br));
+    /* Start as if a clear code had just been read: streams usually begin
+     * with one, but needn't, and there's no previous string to add an entry
+     * for until the first code after it. */
+    key = clear;
+    str_len = 0;
+    table_is_full = 0;
     ret = 0;
     while (1) {
+        added = 0;
         if (key == clear) {
             // Serial.println("Clear key, reset nentries");
             key_size = init_key_size;
             gif->table->nentries = (1 << (key_size - 1)) + 2;
             table_is_full = 0;
+            /* A widening due before the clear is void after it. */
+            ret = 0;
         } else if (!table_is_full) {
             // Serial.println("Add entry to table");
-            ret = add_entry(gif->table, str_len + 1, key, entry.suffix);
-            // if (ret == -1) {
-            //     // Serial.println("Table entry add failure");
-            //     free(table);
-            //     return -1;
-            // }
+            ret = add_entry(gif->table, str_len + 1, key, 0);
+            added = 1;
             if (gif->table->nentries == 0x1000) {
                 // Serial.println("Table is full");
                 ret = 0;
@@ -381,33 +919,128 @@ read_image_data(gd_GIF *gif, int interlace)
             }
         }
         // Serial.println("Get key");
-        key = get_key(gif, key_size, &sub_len, &shift, &byte);
+        key = get_key(gif, &br, key_size);
         if (key == clear) continue;
-        if (key == stop) break;
+        if (key == stop || key == 0xFFFF) break;
+        if (key >= gif->table->nentries) break; /* invalid code */
         if (ret == 1) key_size++;
-        entry = gif->table->entries[key];
-        str_len = entry.length;
-        // Serial.println("Interpret key");
-        while (1) {
-            p = frm_off + entry.length - 1;
-            x = p % gif->fw;
-            y = p / gif->fw;
-            if (interlace)
-                y = interlaced_line_index((int) gif->fh, y);
-            gif->frame[(gif->fy + y) * gif->width + gif->fx + x] = entry.suffix;
-            if (entry.prefix == 0xFFF)
-                break;
+        /* The entry added for the previous code ends with this string's first
+         * pixel. For KwKwK (key is that entry) first[] already holds it. */
+        if (added)
+            entries[gif->table->nentries - 1] |=
+                (gd_Entry) gif->table->first[key] << 12;
+        entry = entries[key];
+        str_len = GD_ENTRY_LENGTH(entry);
+        if (clipped) {
+            n = MIN(str_len, left);
+            put_clipped(gif, entry, str_len, n, &x, &y, tindex, interlace);
+            left -= n;
+            continue;
+        }
+        if (gif->line) {
+            n = MIN(str_len, left);
+            put_streamed(gif, entry, str_len, n, &x, &y, tindex);
+            left -= n;
+        } else if (gif->decimate) {
+            n = MIN(str_len, left);
+            put_decimated(gif, entry, str_len, n, &x, &y, tindex);
+            left -= n;
+        } else if (str_len <= left && x + str_len <= run_end) {
+            /* Whole string lands in the current run. */
+            p16 = &gif->canvas[row + x + str_len];
+            if (tindex < 0)
+                put_run_opaque(p16, entry, entries, colors);
             else
-                entry = gif->table->entries[entry.prefix];
+                put_run_keyed(p16, entry, entries, colors, tindex);
+            x += str_len;
+            left -= str_len;
+        } else {
+            /* String wraps onto following rows, or runs past the end of the
+             * frame, in which case its tail is dropped. */
+            n = MIN(str_len, left);
+            if (n > 0) {
+                for (cx = str_len - n; cx > 0; cx--)
+                    entry = entries[GD_ENTRY_PREFIX(entry)];
+                cy = y;
+                cx = x + n;
+                while (cx > gif->fw) {
+                    cx -= gif->fw;
+                    cy++;
+                }
+                off = gif->rows[cy] + cx;
+                while (1) {
+                    put_pixel(gif, --off, GD_ENTRY_SUFFIX(entry), tindex);
+                    if (--n == 0)
+                        break;
+                    if (--cx == 0) {
+                        cy--;
+                        cx = gif->fw;
+                        off = gif->rows[cy] + cx;
+                    }
+                    entry = entries[GD_ENTRY_PREFIX(entry)];
+                }
+                n = MIN(str_len, left);
+                x += n;
+                left -= n;
+            }
         }
-        frm_off += str_len;
-        if (key < gif->table->nentries - 1 && !table_is_full)
-            gif->table->entries[gif->table->nentries - 1].suffix = entry.suffix;
-    }
-    // Serial.println("Done w/ img data, free table and seek to end");
-    // free(table);
-    gif->fd->read(&sub_len, 1); /* Must be zero! */
-    // gif->fd->seek(end, SeekSet);
+        if (x >= gif->fw && left > 0) {
+            while (x >= gif->fw) {
+                x -= gif->fw;
+                y++;
+            }
+            row = gif->rows[y];
+        }
+    }
+    // Serial.println("Done w/ img data");
+    if (gif->line)
+        flush_band(gif);
+    /* The reservoir may have read ahead into the last sub-block; skip what is
+     * left of it and the block terminator. */
+    if (!br.done) {
+        skip_bytes(gif, br.sub_len);
+        discard_sub_blocks(gif);
+    }
+    return 0;
+}
+
+/* The part of the canvas the current frame's rect is kept in. */
+static void
+canvas_rect(gd_GIF *gif, uint16_t *x, uint16_t *y, uint16_t *w, uint16_t *h)
+{
+    *x = gif->ax.first[gif->fx];
+    *y = gif->ay.first[gif->fy];
+    *w = gif->ax.first[gif->fx + gif->fw] - *x;
+    *h = gif->ay.first[gif->fy + gif->fh] - *y;
+    /* No kept columns means no kept pixels at all, and the other way. */
+    if (!*w || !*h)
+        *w = *h = 0;
+}
+
+/* Copy the canvas under the frame about to be decoded to gif->save, to be
+ * put back when the frame is disposed of. The buffer only ever grows, to
+ * the largest such frame seen, rather than being a second canvas.
+ * Return 0 on success or -1 on out-of-memory. */
+static int
+save_rect(gd_GIF *gif)
+{
+    uint16_t x, y, w, h;
+    uint32_t len;
+    uint16_t *save, *src;
+    int j;
+
+    canvas_rect(gif, &x, &y, &w, &h);
+    len = w * h;
+    if (len > gif->save_len) {
+        save = (uint16_t *) realloc(gif->save, len * sizeof(uint16_t));
+        if (!save)
+            return -1;
+        gif->save = save;
+        gif->save_len = len;
+    }
+    src = &gif->canvas[y * gif->canvas_w + x];
+    for (j = 0; j < h; j++, src += gif->canvas_w)
+        memcpy(&gif->save[j * w], src, w * sizeof(uint16_t));
     return 0;
 }
 
@@ -421,67 +1054,132 @@ read_image(gd_GIF *gif)
 
     /* Image Descriptor. */
     // Serial.println("Read image descriptor");
-    gif->fx = read_num(gif->fd);
-    gif->fy = read_num(gif->fd);
-    gif->fw = read_num(gif->fd);
-    gif->fh = read_num(gif->fd);
+    gif->fx = read_num(gif);
+    gif->fy = read_num(gif);
+    gif->iw = read_num(gif);
+    gif->ih = read_num(gif);
     // Serial.println("Read fisrz?");
-    gif->fd->read(&fisrz, 1);
+    fisrz = read_byte(gif);
+    if (gif->fx >= gif->width || gif->fy >= gif->height) {
+        /* None of it shows, so treat the frame as empty, at the origin so
+         * its rect can still be looked up in the axis maps. */
+        if (fisrz & 0x80)
+            skip_bytes(gif, 3 << ((fisrz & 0x07) + 1));
+        gif->fx = gif->fy = 0;
+        gif->fw = gif->fh = 0;
+        skip_bytes(gif, 1); /* LZW minimum code size */
+        discard_sub_blocks(gif);
+        return 0;
+    }
+    /* Only the part on the logical screen is kept, like browsers do. */
+    gif->fw = MIN(gif->iw, gif->width - gif->fx);
+    gif->fh = MIN(gif->ih, gif->height - gif->fy);
     interlace = fisrz & 0x40;
     /* Ignore Sort Flag. */
     /* Local Color Table? */
     if (fisrz & 0x80) {
         /* Read LCT */
         // Serial.println("Read LCT");
-        read_palette(gif->fd, &gif->lct, 1 << ((fisrz & 0x07) + 1));
+        read_palette(gif, &gif->lct, 1 << ((fisrz & 0x07) + 1));
         gif->palette = &gif->lct;
     } else
         gif->palette = &gif->gct;
+    if (gif->gce.disposal == 3 && gif->canvas && save_rect(gif) == -1)
+        return -1;
     /* Image Data. */
     // Serial.println("Read image data");
     return read_image_data(gif, interlace);
 }
 
-static void
-render_frame_rect(gd_GIF *gif, uint16_t *buffer)
-{
-    int i, j, k;
-    uint8_t index, *color;
-    i = gif->fy * gif->width + gif->fx;
-    for (j = 0; j < gif->fh; j++) {
-        for (k = 0; k < gif->fw; k++) {
-            index = gif->frame[(gif->fy + j) * gif->width + gif->fx + k];
-            // color = &gif->palette->colors[index*2];
-            if (!gif->gce.transparency || index != gif->gce.tindex)
-                buffer[(i+k)] = gif->palette->colors[index];
-                // memcpy(&buffer[(i+k)*2], color, 2);
-        }
-        i += gif->width;
-    }
-}
-
 static void
 dispose(gd_GIF *gif)
 {
     int i, j, k;
+    uint16_t x, y, w, h;
     uint16_t bgcolor;
+
+    if (!gif->canvas) {
+        if (gif->gce.disposal == 2) {
+            gd_output_rect(gif, &x, &y, &w, &h);
+            stream_fill(gif, x, y, w, h, gif->palette->colors[gif->bgindex]);
+        }
+        return;
+    }
+    canvas_rect(gif, &x, &y, &w, &h);
     switch (gif->gce.disposal) {
     case 2: /* Restore to background color. */
         bgcolor = gif->palette->colors[gif->bgindex];
-        i = gif->fy * gif->width + gif->fx;
-        for (j = 0; j < gif->fh; j++) {
-            for (k = 0; k < gif->fw; k++)
+        i = y * gif->canvas_w + x;
+        for (j = 0; j < h; j++) {
+            for (k = 0; k < w; k++)
                 gif->canvas[i+k] = bgcolor;
                 // memcpy(&gif->canvas[(i+k)*3], bgcolor, 3);
-            i += gif->width;
+            i += gif->canvas_w;
         }
         break;
-    case 3: /* Restore to previous, i.e., don't update canvas.*/
+    case 3: /* Restore to previous, from what save_rect() kept. */
+        for (j = 0; j < h; j++)
+            memcpy(&gif->canvas[(y + j) * gif->canvas_w + x],
+                   &gif->save[j * w], w * sizeof(uint16_t));
         break;
     default:
-        /* Add frame non-transparent pixels to canvas. */
-        render_frame_rect(gif, gif->canvas);
+        /* Leave the frame's pixels, already decoded into the canvas. */
+        break;
+    }
+}
+
+/* Keyframes are a whole canvas each, so on the ESP32 they're only kept
+ * in PSRAM. */
+static void *
+alloc_keyframe(size_t size)
+{
+#ifdef ESP32
+    return psramFound() ? ps_malloc(size) : NULL;
+#else
+    return malloc(size);
+#endif
+}
+
+/* Called on the first pass only, right before the frame that will be
+ * gif->nframes is decoded: save a keyframe if one is due. */
+static void
+save_keyframe(gd_GIF *gif)
+{
+    int k;
+    size_t size = gif->canvas_w * gif->canvas_h * sizeof(uint16_t);
+
+    if (!gif->canvas || !gif->nframes || gif->nframes % GD_KEYFRAME_INTERVAL)
+        return;
+    k = gif->nframes / GD_KEYFRAME_INTERVAL - 1;
+    if (k >= GD_MAX_KEYFRAMES || gif->keyframes[k])
+        return;
+    gif->keyframes[k] = (uint16_t *) alloc_keyframe(size);
+    if (gif->keyframes[k])
+        memcpy(gif->keyframes[k], gif->canvas, size);
+}
+
+/* Record the frame just decoded. If the index can't grow, it just stops;
+ * seeking past its end decodes forward from there. */
+static void
+index_frame(gd_GIF *gif, off_t offset)
+{
+    gd_FrameInfo *info;
+
+    if (gif->nframes == gif->index_size) {
+        uint16_t size = gif->index_size ? gif->index_size * 2 : 16;
+        info = (gd_FrameInfo *) realloc(gif->index, size * sizeof(*info));
+        if (!info)
+            return;
+        gif->index = info;
+        gif->index_size = size;
     }
+    info = &gif->index[gif->nframes++];
+    info->offset = offset;
+    info->gce = gif->gce;
+    info->fx = gif->fx;
+    info->fy = gif->fy;
+    info->fw = gif->fw;
+    info->fh = gif->fh;
 }
 
 /* Return 1 if got a frame; 0 if got GIF trailer; -1 if error. */
@@ -489,11 +1187,19 @@ int
 gd_get_frame(gd_GIF *gif)
 {
     char sep;
+    uint32_t t0, t1;
+    off_t offset = tell(gif);
+    int indexing = gif->cur_frame == gif->nframes;
 
     // Serial.println("Dispose frame");
+    t0 = micros();
     dispose(gif);
+    if (indexing)
+        save_keyframe(gif);
+    t1 = micros();
+    gif->timing.compose = t1 - t0;
     while (1) {
-        gif->fd->read((uint8_t*) &sep, 1);
+        sep = read_byte(gif);
         // Serial.print("Read sep: ");Serial.println(sep);
         if (sep == ',')
             break;
@@ -503,31 +1209,144 @@ gd_get_frame(gd_GIF *gif)
             read_ext(gif);
         else return -1;
     }
+    t0 = micros();
+    gif->timing.ext = t0 - t1;
     // Serial.println("Do read image");
     if (read_image(gif) == -1)
         return -1;
+    gif->timing.lzw = micros() - t0;
+    if (indexing)
+        index_frame(gif, offset);
+    gif->cur_frame++;
     return 1;
 }
 
+/* Scale the canvas into buffer (out_w x out_h) through the axis maps, with
+ * black borders around it. Repeated lines are copied from the one above. */
+static void
+render_scaled(gd_GIF *gif, uint16_t *buffer)
+{
+    const gd_Axis *ax = &gif->ax, *ay = &gif->ay;
+    uint16_t *dst, *src;
+    int ox, oy;
+
+    for (oy = 0; oy < gif->out_h; oy++) {
+        dst = &buffer[oy * gif->out_w];
+        if (oy < ay->start || oy >= ay->end) {
+            memset(dst, 0, gif->out_w * sizeof(uint16_t));
+            continue;
+        }
+        if (oy > ay->start && ay->show[oy] == ay->show[oy - 1]) {
+            memcpy(dst, dst - gif->out_w, gif->out_w * sizeof(uint16_t));
+            continue;
+        }
+        src = &gif->canvas[ay->show[oy] * gif->canvas_w];
+        for (ox = 0; ox < ax->start; ox++)
+            dst[ox] = 0;
+        for (; ox < ax->end; ox++)
+            dst[ox] = src[ax->show[ox]];
+        for (; ox < gif->out_w; ox++)
+            dst[ox] = 0;
+    }
+}
+
 void
 gd_render_frame(gd_GIF *gif, uint16_t *buffer)
 {
+    uint32_t t0 = micros();
+
     // Serial.println("Copy canvas to buffer");
-    memcpy(buffer, gif->canvas, gif->width * gif->height * 2);
-    // Serial.println("render frame to buffer");
-    render_frame_rect(gif, buffer);
+    if (!gif->canvas)
+        return;
+    if (gif->canvas_w == gif->out_w && gif->canvas_h == gif->out_h)
+        memcpy(buffer, gif->canvas, gif->out_w * gif->out_h * 2);
+    else
+        render_scaled(gif, buffer);
+    gif->timing.compose += micros() - t0;
+}
+
+/* The area of gd_render_frame()'s output the current frame's rect covers. */
+void
+gd_output_rect(gd_GIF *gif, uint16_t *x, uint16_t *y, uint16_t *w, uint16_t *h)
+{
+    uint16_t cx, cy, cw, ch;
+
+    canvas_rect(gif, &cx, &cy, &cw, &ch);
+    *x = gif->ax.shown_at[cx];
+    *y = gif->ay.shown_at[cy];
+    *w = gif->ax.shown_at[cx + cw] - *x;
+    *h = gif->ay.shown_at[cy + ch] - *y;
 }
 
+/* Go back to the state right after gd_open_gif(), so every loop is drawn
+ * exactly like the first. */
 void
 gd_rewind(gd_GIF *gif)
 {
-    gif->fd->seek(gif->anim_start, SeekSet);
+    gd_seek_frame(gif, 0);
+}
+
+/* Whether frame info hides everything drawn before it. */
+static int
+covers_screen(gd_GIF *gif, const gd_FrameInfo *info)
+{
+    return !info->fx && !info->fy && info->fw == gif->width
+        && info->fh == gif->height && !info->gce.transparency;
+}
+
+/* Make frame n the next one gd_get_frame() returns. Starts from the nearest
+ * keyframe (or the beginning) at or before n and decodes forward, so frames
+ * past the index are reached too; when streaming, those go to band() as
+ * well. Return 0 on success, -1 if the GIF ends or fails to decode before
+ * frame n. */
+int
+gd_seek_frame(gd_GIF *gif, uint16_t n)
+{
+    int k;
+    uint16_t start;
+
+    /* Restart from a keyframe only if the frame it precedes is indexed. */
+    k = MIN(n, gif->nframes ? gif->nframes - 1 : 0) / GD_KEYFRAME_INTERVAL;
+    k = MIN(k, GD_MAX_KEYFRAMES);
+    while (k && !gif->keyframes[k - 1])
+        k--;
+    start = k * GD_KEYFRAME_INTERVAL;
+    if (k)
+        memcpy(gif->canvas, gif->keyframes[k - 1], gif->canvas_w * gif->canvas_h * sizeof(uint16_t));
+    else if (gif->canvas)
+        memset(gif->canvas, 0, gif->canvas_w * gif->canvas_h * sizeof(uint16_t));
+    else if (!gif->nframes || !covers_screen(gif, &gif->index[0]))
+        /* What the canvas would be cleared to. */
+        stream_fill(gif, 0, 0, gif->out_w, gif->out_h, 0);
+    seek_to(gif, start ? gif->index[start].offset : gif->anim_start);
+    /* The canvas is already disposed of; a frame without a GCE keeps the
+     * previous frame's. */
+    if (start)
+        gif->gce = gif->index[start - 1].gce;
+    else
+        memset(&gif->gce, 0, sizeof(gif->gce));
+    gif->fw = gif->fh = 0;
+    gif->cur_frame = start;
+
+    while (gif->cur_frame < n) {
+        if (gd_get_frame(gif) <= 0)
+            return -1;
+    }
+    return 0;
 }
 
 void
 gd_close_gif(gd_GIF *gif)
 {
+    int k;
+
     gif->fd->close();
-    free(gif->table);
+    if (last_lct.dest == &gif->lct)
+        last_lct.dest = NULL;
+    for (k = 0; k < GD_MAX_KEYFRAMES; k++)
+        free(gif->keyframes[k]);
+    free(gif->index);
+    free(gif->save);
+    free(gif->canvas);
     free(gif);
 }
@@ -5,6 +5,16 @@
 // #include <sys/types.h>
 #include <SD.h>
 
+/* Size of the read-ahead buffer. File reads are issued in chunks aligned to
+ * this size, so it should be a multiple of the SD sector size (512). */
+#define GD_READ_BUF_SIZE 512
+
+/* The first time through, the canvas is saved every GD_KEYFRAME_INTERVAL
+ * frames (up to GD_MAX_KEYFRAMES times) so gd_seek_frame() only has to
+ * decode from the nearest one. */
+#define GD_KEYFRAME_INTERVAL 32
+#define GD_MAX_KEYFRAMES 4
+
 typedef struct gd_RGBColor {
     uint8_t r;
     uint8_t g;
@@ -24,18 +34,59 @@ typedef struct gd_GCE {
     int transparency;
 } gd_GCE;
 
-typedef struct gd_Entry {
-    uint16_t length;
-    uint16_t prefix;
-    uint8_t  suffix;
-} gd_Entry;
+/* LZW dictionary entry, packed as length:12 | suffix:8 | prefix:12. */
+typedef uint32_t gd_Entry;
+
+#define GD_ENTRY(length, prefix, suffix) \
+    (((uint32_t) (length) << 20) | ((uint32_t) (suffix) << 12) | (prefix))
+#define GD_ENTRY_LENGTH(e) ((e) >> 20)
+#define GD_ENTRY_SUFFIX(e) (((e) >> 12) & 0xFF)
+#define GD_ENTRY_PREFIX(e) ((e) & 0xFFF)
 
 typedef struct gd_Table {
-    int bulk;
     int nentries;
-    gd_Entry *entries;
+    gd_Entry entries[4096];
+    uint8_t first[4096]; /* first pixel of each string */
 } gd_Table;
 
+/* Microseconds spent in each stage of the last gd_get_frame() and
+ * gd_render_frame() calls. */
+typedef struct gd_Timing {
+    uint32_t ext;     /* extension blocks */
+    uint32_t lzw;     /* image descriptor and image data */
+    uint32_t compose; /* disposal of the previous frame and compositing */
+} gd_Timing;
+
+/* Scaling modes for gd_open_gif_scaled(). Both keep the aspect ratio. */
+#define GD_SCALE_FIT  0  /* all of the image shows, with borders around it */
+#define GD_SCALE_FILL 1  /* the image covers the output and is center-cropped */
+#define GD_SCALE_MASK 0x0F
+/* Or'ed into the mode: keep no canvas, send each frame to gif->band as
+ * it's decoded instead (see gd_GIF). */
+#define GD_STREAM 0x10
+
+/* Rows of output gathered before they're sent to gif->band. */
+#define GD_BAND_ROWS 8
+
+/* How one axis of the logical screen maps to the canvas and to the output.
+ * The decoder only keeps source pixels that some output pixel shows, so on
+ * a shrinking axis the canvas is no bigger than the output. */
+typedef struct gd_Axis {
+    int16_t *keep;      /* [source]: canvas index it's kept at, or -1 */
+    uint16_t *first;    /* [source + 1]: canvas index of the first kept one at or after it */
+    uint16_t *show;     /* [output]: canvas index shown there, for start <= output < end */
+    uint16_t *shown_at; /* [canvas + 1]: first output showing it or a later one */
+    uint16_t *source;   /* [canvas]: source index kept there */
+    uint16_t start, end; /* outputs the image covers; the rest is border */
+} gd_Axis;
+
+/* Where a frame starts in the file, and what disposing of it needs. */
+typedef struct gd_FrameInfo {
+    off_t offset;   /* first block after the previous frame's image data */
+    gd_GCE gce;
+    uint16_t fx, fy, fw, fh;
+} gd_FrameInfo;
+
 typedef struct gd_GIF {
     File* fd;
     off_t anim_start;
@@ -52,20 +103,50 @@ typedef struct gd_GIF {
     );
     void (*comment)(struct gd_GIF *gif);
     void (*application)(struct gd_GIF *gif, char id[8], char auth[3]);
-    uint16_t fx, fy, fw, fh;
+    uint16_t fx, fy, fw, fh;  /* current frame's rect, cut to the logical screen */
+    uint16_t iw, ih;          /* size of its image data, which may stick out */
     uint8_t bgindex;
     uint16_t *canvas;
-    uint8_t *frame;
+    uint16_t canvas_w, canvas_h;
+    uint16_t out_w, out_h;  /* size gd_render_frame() renders at */
+    gd_Axis ax, ay;
+    uint8_t decimate;       /* the canvas keeps only some source pixels */
+    /* Streaming (GD_STREAM): there's no canvas, and band() gets the output
+     * pixels of each frame, a band of full rows or, where the frame has
+     * transparent pixels, a run of one row, as soon as they're decoded. The
+     * pixels stay untouched until the next call to band() returns, so they
+     * may be queued for a transfer that finishes before then. Disposal 2
+     * fills with the background through band() too; disposal 3 needs a
+     * canvas, so those frames are left as they are. */
+    void (*band)(struct gd_GIF *gif, uint16_t x, uint16_t y,
+                 uint16_t w, uint16_t h, uint16_t *pixels);
+    uint8_t *line;          /* palette indices of the row being decoded */
+    uint16_t *bands[2];     /* output rows, filled and sent in turn */
+    uint8_t cur_band;
+    uint16_t band_x, band_y, band_w, band_h; /* rows gathered in bands[cur_band] */
+    uint8_t big_endian;  /* colors, and so every pixel, are byte-swapped */
+    uint16_t *save;  /* canvas under the last disposal 3 frame */
+    uint32_t save_len;
+    uint32_t *rows;
     gd_Table* table;
+    gd_Timing timing;
+    gd_FrameInfo *index;  /* frames seen so far, built on the first pass */
+    uint16_t nframes, index_size;
+    uint16_t cur_frame;   /* frame the next gd_get_frame() returns */
+    uint16_t *keyframes[GD_MAX_KEYFRAMES]; /* canvas before frame (i + 1) * GD_KEYFRAME_INTERVAL */
+    off_t buf_off;
+    uint16_t buf_pos, buf_len;
+    uint8_t buf[GD_READ_BUF_SIZE];
 } gd_GIF;
 
+void gd_set_colors(float gamma, uint8_t brightness, int big_endian);
 gd_GIF *gd_open_gif(File* fd);
-static gd_Table * new_table();
-static void reset_table(gd_Table* table, int key_size);
-// int add_entry(gd_Table* table, uint16_t length, uint16_t prefix, uint8_t suffix)
+gd_GIF *gd_open_gif_scaled(File* fd, uint16_t out_w, uint16_t out_h, int mode);
 int gd_get_frame(gd_GIF *gif);
 void gd_render_frame(gd_GIF *gif, uint16_t *buffer);
+void gd_output_rect(gd_GIF *gif, uint16_t *x, uint16_t *y, uint16_t *w, uint16_t *h);
 void gd_rewind(gd_GIF *gif);
+int gd_seek_frame(gd_GIF *gif, uint16_t n);
 void gd_close_gif(gd_GIF *gif);
 
 #endif /* GIFDEC_H */
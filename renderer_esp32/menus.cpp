@@ -4,6 +4,7 @@
 #include "prefs.h"
 #include "version.h"
 #include "battery.h"
+#include "profiler.h"
 #include "menus.h"
 
 
@@ -31,16 +32,47 @@ void version_menu(Adafruit_ST7735* tft, Buttons* buttons) {
     m.render((const char **)text, 2);
 }
 
+void frame_stats_menu(Adafruit_ST7735* tft, Buttons* buttons) {
+    MenuRenderer m = MenuRenderer(tft, buttons);
+    const char* stage_names[PROF_STAGES] = {"ext", "lzw", "comp", "push", "idle"};
+    char lines[PROF_STAGES + 1][32];
+    const char* text[PROF_STAGES + 4];
+    ProfStats stats;
+
+    snprintf(lines[0], sizeof(lines[0]), "Late %lu/%lu", (unsigned long) profiler_late_frames(), (unsigned long) profiler_frames());
+    for (int i = 0; i < PROF_STAGES; i++) {
+        profiler_stats(i, &stats);
+        snprintf(lines[i + 1], sizeof(lines[0]), "%-4s %lu %lu %lu %lu", stage_names[i],
+            (unsigned long) stats.min, (unsigned long) stats.avg, (unsigned long) stats.p99, (unsigned long) stats.max);
+    }
+    text[0] = "Back";
+    text[1] = "Dump To Serial";
+    text[2] = lines[0];
+    text[3] = "us: min avg p99 max";
+    for (int i = 0; i < PROF_STAGES; i++)
+        text[i + 4] = lines[i + 1];
+    while (1) {
+        switch (m.render((const char **)text, PROF_STAGES + 4)) {
+            case 0:
+                return;
+            case 1:
+                profiler_dump(&Serial);
+                break;
+        }
+    }
+}
+
 void system_menu(Adafruit_ST7735* tft, Buttons* buttons) {
     MenuRenderer m = MenuRenderer(tft, buttons);
     const char * text[] = {
         "Back",
         "Battery",
         "Version",
+        "Frame Stats",
         "Update From SD"
     };
     while (1) {
-        switch (m.render((const char **)text, 3)) {
+        switch (m.render((const char **)text, 4)) {
             case 0:
                 return;
             case 1:
@@ -50,6 +82,9 @@ void system_menu(Adafruit_ST7735* tft, Buttons* buttons) {
                 version_menu(tft, buttons);
                 break;
             case 3:
+                frame_stats_menu(tft, buttons);
+                break;
+            case 4:
                 break;
         }
     }
@@ -133,34 +168,55 @@ uint8_t prefs_bri_menu(Adafruit_ST7735* tft, Buttons* buttons) {
 }
 
 
+// Returns 0 to go back, 1 for off, 2 for on
+uint8_t prefs_shuffle_menu(Adafruit_ST7735* tft, Buttons* buttons) {
+    MenuRenderer m = MenuRenderer(tft, buttons);
+    const char * text[] = {
+        "Back",
+        "Off",
+        "On"
+    };
+    return m.render((const char **)text, 3);
+}
+
+
 void preferences_menu(Adafruit_ST7735* tft, Buttons* buttons, Prefs* prefs) {
     MenuRenderer m = MenuRenderer(tft, buttons);
     uint16_t disp_time;
-    uint8_t bri;
+    uint8_t bri, shuffle;
     const char * text[] = {
         "Back",
         "Display Time",
-        "Brightness"
+        "Brightness",
+        "Shuffle"
     };
     while (1) {
-        switch (m.render((const char **)text, 3)) {
+        switch (m.render((const char **)text, 4)) {
             case 0:
                 return;
             case 1:
                 disp_time = prefs_disp_time_menu(tft, buttons);
                 if (disp_time > 0) {
                     prefs->display_time_s = disp_time;
-                    write_prefs(prefs);
+                    save_prefs(prefs);
                 }
                 break;
             case 2:
                 bri = prefs_bri_menu(tft, buttons);
                 if (bri > 0) {
                     prefs->brightness = bri;
-                    write_prefs(prefs);
+                    save_prefs(prefs);
                     // ledcWrite(TFT_BL_CHAN, prefs->brightness);
                 }
                 break;
+            case 3:
+                shuffle = prefs_shuffle_menu(tft, buttons);
+                // Turning it on picks a new order, On again keeps the current one
+                if (shuffle == 1 || (shuffle == 2 && !prefs->shuffle_seed)) {
+                    prefs->shuffle_seed = shuffle == 2 ? esp_random() | 1 : 0;
+                    save_prefs(prefs);
+                }
+                break;
         }
     }
 }
@@ -0,0 +1,155 @@
+#include <Arduino.h>
+#include "catalog.h"
+#include "playlist.h"
+
+#define MIN(A, B) ((A) < (B) ? (A) : (B))
+
+// Catalog entries read per SD access while loading
+#define PLAYLIST_READ_CHUNK 8
+
+// Paths are packed back to back in one arena and found through offsets into
+// it, sorted by path. order is the play order, a permutation of indexes, and
+// position its inverse, so moving around in either takes no searching
+static char* arena = NULL;
+static uint32_t* offsets = NULL;
+static uint16_t *order = NULL, *position = NULL;
+static int count = 0;
+
+// Big libraries go in PSRAM when there is some
+static void* playlist_realloc(void* ptr, size_t size) {
+#ifdef ESP32
+    if (psramFound())
+        return ps_realloc(ptr, size);
+#endif
+    return realloc(ptr, size);
+}
+
+static void playlist_clear() {
+    free(arena);
+    free(offsets);
+    free(order);
+    free(position);
+    arena = NULL;
+    offsets = NULL;
+    order = position = NULL;
+    count = 0;
+}
+
+static int compare_offsets(const void* a, const void* b) {
+    return strcmp(arena + *(const uint32_t*) a, arena + *(const uint32_t*) b);
+}
+
+// Read the total entries of the catalog into RAM. Returns false if they
+// don't fit, in which case the playlist is empty and callers go to the
+// catalog for paths
+bool playlist_load(int total) {
+    CatalogEntry entries[PLAYLIST_READ_CHUNK];
+    size_t used = 0, cap = 0, len;
+    int n;
+    bool sorted = true;
+    void* p;
+
+    playlist_clear();
+    if (total <= 0 || total > PLAYLIST_MAX)
+        return false;
+    offsets = (uint32_t*) playlist_realloc(NULL, total * sizeof(uint32_t));
+    order = (uint16_t*) playlist_realloc(NULL, total * sizeof(uint16_t));
+    position = (uint16_t*) playlist_realloc(NULL, total * sizeof(uint16_t));
+    if (!offsets || !order || !position)
+        goto fail;
+
+    while (count < total) {
+        n = catalog_read(count, entries, MIN(total - count, PLAYLIST_READ_CHUNK));
+        if (n <= 0)
+            goto fail;
+        for (int i = 0; i < n; i++, count++) {
+            len = strlen(entries[i].path) + 1;
+            if (used + len > cap) {
+                cap = cap ? cap * 2 : 4096;
+                if (!(p = playlist_realloc(arena, cap)))
+                    goto fail;
+                arena = (char*) p;
+            }
+            memcpy(arena + used, entries[i].path, len);
+            offsets[count] = used;
+            if (count && strcmp(arena + offsets[count - 1], arena + used) > 0)
+                sorted = false;
+            used += len;
+        }
+    }
+    // The catalog is written sorted, so this is only for one that isn't
+    if (!sorted)
+        qsort(offsets, count, sizeof(uint32_t), compare_offsets);
+    playlist_shuffle(0);
+    return true;
+
+fail:
+    Serial.println("Playlist doesn't fit in memory");
+    playlist_clear();
+    return false;
+}
+
+int playlist_count() {
+    return count;
+}
+
+// Path at index, or NULL if it's out of range or nothing is loaded
+const char* playlist_path(int index) {
+    if (index < 0 || index >= count)
+        return NULL;
+    return arena + offsets[index];
+}
+
+// Binary search for path. Returns its index or -1
+int playlist_find(const char* path) {
+    int lo = 0, hi = count - 1, mid, cmp;
+
+    if (path == NULL || !path[0])
+        return -1;
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        cmp = strcmp(path, arena + offsets[mid]);
+        if (cmp == 0)
+            return mid;
+        if (cmp < 0)
+            hi = mid - 1;
+        else
+            lo = mid + 1;
+    }
+    return -1;
+}
+
+// Fisher-Yates shuffle of the play order driven by xorshift32 from seed, so
+// the same seed always gives the same order. Seed 0 plays in path order
+void playlist_shuffle(uint32_t seed) {
+    uint32_t x = seed;
+    uint16_t tmp;
+    int i, j;
+
+    for (i = 0; i < count; i++)
+        order[i] = i;
+    if (seed) {
+        for (i = count - 1; i > 0; i--) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            j = x % (i + 1);
+            tmp = order[i];
+            order[i] = order[j];
+            order[j] = tmp;
+        }
+    }
+    for (i = 0; i < count; i++)
+        position[order[i]] = i;
+}
+
+// Index of the GIF at a position in the play order. Without a playlist the
+// play order is the catalog's
+int playlist_at(int pos) {
+    return count ? order[pos] : pos;
+}
+
+// Position of the GIF at index in the play order
+int playlist_position(int index) {
+    return count ? position[index] : index;
+}
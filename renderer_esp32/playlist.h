@@ -0,0 +1,19 @@
+#ifndef _PLAYLIST_H_
+#define _PLAYLIST_H_
+
+#include <Arduino.h>
+
+// Most GIFs the playlist holds; positions are 16 bit
+#define PLAYLIST_MAX 65535
+
+// The catalog's paths held in RAM, sorted, with a play order on top. Index
+// means position in path order, position means place in the play order
+bool playlist_load(int total);
+int playlist_count();
+const char* playlist_path(int index);
+int playlist_find(const char* path);
+void playlist_shuffle(uint32_t seed);
+int playlist_at(int position);
+int playlist_position(int index);
+
+#endif
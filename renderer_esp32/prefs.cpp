@@ -1,6 +1,13 @@
 #include <SD.h>
 #include "prefs.h"
 
+// save_prefs() only takes a copy; the card is written by flush_prefs(),
+// which may run on another task, so the copy is shared under a mutex
+static SemaphoreHandle_t lock;
+static Prefs pending, stored;
+static bool dirty = false;
+static uint32_t changed_at;
+
 void set_pref_last_filename(Prefs* prefs, const char* filename) {
     prefs->last_filename[0] = 0;
 
@@ -10,37 +17,106 @@ void set_pref_last_filename(Prefs* prefs, const char* filename) {
     strcpy(prefs->last_filename, filename);
 }
 
-void write_prefs(Prefs* prefs) {
+// FNV-1a over the packed struct
+static uint32_t prefs_checksum(const Prefs* prefs) {
+    const uint8_t* p = (const uint8_t*) prefs;
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < sizeof(Prefs); i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Overwrite the prefs at the start of the file rather than recreating it.
+// The checksum goes after them, so a write cut short reads back as invalid
+static bool store_prefs(const Prefs* prefs) {
+    uint32_t checksum = prefs_checksum(prefs);
     File file;
-    file = SD.open(PREFS_FILENAME, FILE_WRITE);
-    if (!file) {
+
+    file = SD.open(PREFS_FILENAME, "r+");
+    if (!file)
+        file = SD.open(PREFS_FILENAME, FILE_WRITE);
+    if (!file || !file.seek(0)) {
         Serial.print("Can't write to ");
         Serial.println(PREFS_FILENAME);
-        return;
+        file.close();
+        return false;
     }
+    file.write((const uint8_t*) prefs, sizeof(Prefs));
+    file.write((const uint8_t*) &checksum, sizeof(checksum));
+    file.close();
+    return true;
+}
 
+// Note that prefs changed. Nothing is written until flush_prefs(), so this
+// never waits on the card
+void save_prefs(Prefs* prefs) {
     prefs->version = PREFS_VERSION;
-    file.write((uint8_t*)prefs, sizeof(Prefs));
-    file.close();
+    xSemaphoreTake(lock, portMAX_DELAY);
+    memcpy(&pending, prefs, sizeof(Prefs));
+    dirty = true;
+    changed_at = millis();
+    xSemaphoreGive(lock);
+}
+
+// Write the prefs last saved if they've been left alone for PREFS_QUIET_MS,
+// or right away if now. Only call where the SD card is free to use. Returns
+// true if the card was written
+bool flush_prefs(bool now) {
+    Prefs prefs;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (!dirty || (!now && millis() - changed_at < PREFS_QUIET_MS)) {
+        xSemaphoreGive(lock);
+        return false;
+    }
+    memcpy(&prefs, &pending, sizeof(Prefs));
+    dirty = false;
+    xSemaphoreGive(lock);
+
+    // Changed and changed back since the last write
+    if (!memcmp(&prefs, &stored, sizeof(Prefs)))
+        return false;
+    if (store_prefs(&prefs)) {
+        memcpy(&stored, &prefs, sizeof(Prefs));
+    } else {
+        // Try again after another quiet period
+        xSemaphoreTake(lock, portMAX_DELAY);
+        if (!dirty) {
+            dirty = true;
+            changed_at = millis();
+        }
+        xSemaphoreGive(lock);
+    }
+    return true;
 }
 
 void read_prefs(Prefs* prefs) {
     File file;
     uint16_t version;
+    uint32_t checksum;
+    Prefs read;
+
+    if (!lock)
+        lock = xSemaphoreCreateMutex();
 
     prefs->version = PREFS_VERSION;
     prefs->display_time_s = 10;
     prefs->last_filename[0] = 0;
     prefs->brightness = 255;
+    prefs->shuffle_seed = 0;
 
     file = SD.open(PREFS_FILENAME);
     if (!file) {
-        write_prefs(prefs);
+        save_prefs(prefs);
+        flush_prefs(true);
         return;
     }
 
     file.read((uint8_t*) &version, 2);
-    if (version < 1 || version > 2) {
+    if (version < 1 || version > PREFS_VERSION) {
         Serial.print("Invalid prefs version, expected ");
         Serial.print(PREFS_VERSION);
         Serial.print(", got ");
@@ -54,5 +130,16 @@ void read_prefs(Prefs* prefs) {
         file.read((uint8_t*)prefs, 132);
     else if (version == 2)
         file.read((uint8_t*)prefs, 133);
+    else if (version == 3)
+        file.read((uint8_t*)prefs, 137);
+    else if (file.read((uint8_t*) &read, sizeof(read)) == sizeof(read)
+            && file.read((uint8_t*) &checksum, sizeof(checksum)) == sizeof(checksum)
+            && checksum == prefs_checksum(&read)) {
+        memcpy(prefs, &read, sizeof(Prefs));
+        // Already on the card as they are
+        memcpy(&stored, &read, sizeof(Prefs));
+    } else {
+        Serial.println("Invalid prefs checksum");
+    }
     file.close();
 }
@@ -3,18 +3,25 @@
 
 #include <SD.h>
 
-#define PREFS_VERSION 2
+#define PREFS_VERSION 4
 #define PREFS_FILENAME "/preferences.bin"
+// How long prefs have to stay unchanged before they're written out, so a
+// run of changes (skipping through files) costs one write
+#define PREFS_QUIET_MS 5000
 
+// Stored at the start of PREFS_FILENAME, followed by a checksum of it since
+// version 4
 typedef struct {
     uint16_t version;
     uint16_t display_time_s;
     char last_filename[128];
     uint8_t brightness;
+    uint32_t shuffle_seed;  // play order, 0 for path order
 } __attribute__ ((packed)) Prefs;
 
 void set_pref_last_filename(Prefs* prefs, const char* filename);
-void write_prefs(Prefs* prefs);
+void save_prefs(Prefs* prefs);
+bool flush_prefs(bool now);
 void read_prefs(Prefs* prefs);
 
-#endif
\ No newline at end of file
+#endif
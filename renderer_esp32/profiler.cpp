@@ -0,0 +1,85 @@
+#include <Arduino.h>
+#include "profiler.h"
+
+// Per-frame timings of the GIF being shown. Only touched from loop(), so
+// there's no locking
+
+static ProfSample ring[PROF_RING_SIZE];
+static uint16_t head = 0, count = 0;
+static uint32_t frames = 0, late_frames = 0;
+static char name[PROF_NAME_LEN];
+
+
+static int cmp_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+// Start over for a new GIF
+void profiler_reset(const char* gif_name) {
+    head = count = 0;
+    frames = late_frames = 0;
+    strncpy(name, gif_name, PROF_NAME_LEN - 1);
+    name[PROF_NAME_LEN - 1] = 0;
+}
+
+void profiler_record(const ProfSample* sample) {
+    ring[head] = *sample;
+    head = (head + 1) % PROF_RING_SIZE;
+    if (count < PROF_RING_SIZE)
+        count++;
+    // Counted over the whole GIF, not just what's still in the ring
+    frames++;
+    if (sample->late > PROF_LATE_US)
+        late_frames++;
+}
+
+uint16_t profiler_count() {
+    return count;
+}
+
+uint32_t profiler_frames() {
+    return frames;
+}
+
+uint32_t profiler_late_frames() {
+    return late_frames;
+}
+
+// Statistics for one stage over the samples in the ring
+void profiler_stats(int stage, ProfStats* stats) {
+    uint32_t values[PROF_RING_SIZE];
+    uint64_t sum = 0;
+
+    if (!count) {
+        *stats = (ProfStats) {0, 0, 0, 0};
+        return;
+    }
+    for (uint16_t i = 0; i < count; i++) {
+        values[i] = ring[i].us[stage];
+        sum += values[i];
+    }
+    qsort(values, count, sizeof(uint32_t), cmp_u32);
+    stats->min = values[0];
+    stats->max = values[count - 1];
+    stats->avg = sum / count;
+    // Nearest rank
+    stats->p99 = values[(count * 99 + 99) / 100 - 1];
+}
+
+// Write the header and the samples in the ring, oldest first
+void profiler_dump(Stream* out) {
+    ProfDumpHeader header;
+    uint16_t start = (head + PROF_RING_SIZE - count) % PROF_RING_SIZE;
+
+    memcpy(header.magic, "GPRF", 4);
+    header.version = PROF_DUMP_VERSION;
+    header.stages = PROF_STAGES;
+    header.count = count;
+    header.late_frames = late_frames;
+    memcpy(header.name, name, PROF_NAME_LEN);
+    out->write((const uint8_t*) &header, sizeof(header));
+    for (uint16_t i = 0; i < count; i++)
+        out->write((const uint8_t*) &ring[(start + i) % PROF_RING_SIZE], sizeof(ProfSample));
+    out->flush();
+}
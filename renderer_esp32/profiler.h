@@ -0,0 +1,55 @@
+#ifndef _PROFILER_H_
+#define _PROFILER_H_
+
+#include <Arduino.h>
+
+// Samples kept per GIF. Statistics cover the last this many frames
+#define PROF_RING_SIZE 128
+#define PROF_NAME_LEN 128
+// Frames that go out later than this after their deadline count as missed
+#define PROF_LATE_US 1000
+
+// Bumped whenever the layout of the binary dump changes
+#define PROF_DUMP_VERSION 1
+
+enum {
+    PROF_EXT,      // extension blocks
+    PROF_LZW,      // image data
+    PROF_COMPOSE,  // disposal and compositing
+    PROF_PUSH,     // SPI transfer to the TFT
+    PROF_IDLE,     // waiting for the frame's deadline
+    PROF_STAGES
+};
+
+// Timings of one frame, in microseconds. late is how long after its deadline
+// the frame went out
+typedef struct __attribute__((packed)) {
+    uint32_t us[PROF_STAGES];
+    uint32_t late;
+    uint16_t delay_cs;
+} ProfSample;
+
+typedef struct {
+    uint32_t min, avg, max, p99;
+} ProfStats;
+
+// The binary dump is this header followed by count ProfSamples, oldest
+// first, all little endian
+typedef struct __attribute__((packed)) {
+    char magic[4];  // "GPRF"
+    uint8_t version;
+    uint8_t stages;
+    uint16_t count;
+    uint32_t late_frames;
+    char name[PROF_NAME_LEN];
+} ProfDumpHeader;
+
+void profiler_reset(const char* name);
+void profiler_record(const ProfSample* sample);
+uint16_t profiler_count();
+uint32_t profiler_frames();
+uint32_t profiler_late_frames();
+void profiler_stats(int stage, ProfStats* stats);
+void profiler_dump(Stream* out);
+
+#endif
@@ -3,9 +3,13 @@
 #include "Buttons_impl.h"
 #include "Menu_impl.h"
 #include "FileList_impl.h"
+#include "Pipeline_impl.h"
+#include "Scheduler_impl.h"
 #include "prefs.h"
 #include "gifdec.h"
 #include "menus.h"
+#include "display.h"
+#include "profiler.h"
 #include "version.h"
 
 // Definitions of pin numbers for the TFT
@@ -24,15 +28,29 @@
 #define BTN_M   25
 #define BTN_R   26
 
+// Played with all its subdirectories
 #define GIFS_DIRECTORY "/"
 
+// poll_buttons() result when the menu was shown
+#define BTN_MENU 2
+// Longest the render loop sleeps between button checks
+#define BTN_POLL_US 5000
+// How long before display_time_s runs out the next GIF is opened
+#define PREFETCH_LEAD_MS 2000
+
 
 Adafruit_ST7735 tft = Adafruit_ST7735(TFT_CS,  TFT_DC, TFT_RST);
 Buttons buttons = Buttons(BTN_L, BTN_M, BTN_R);
 FileList files = FileList(GIFS_DIRECTORY);
 Prefs prefs;
+FrameScheduler scheduler;
 
-uint16_t screen[16384];
+// One screen buffer per pipeline slot: one is on its way to the TFT while
+// the decode task fills the other
+uint16_t screen[PIPELINE_DEPTH][SCREEN_W * SCREEN_H];
+Pipeline pipeline = Pipeline(screen[0], SCREEN_W * SCREEN_H);
+// Set while a GIF plays without the pipeline, see play_streamed()
+bool streaming = false;
 
 
 // Setup method runs once, when the sketch starts
@@ -75,73 +93,236 @@ void setup() {
     files.init(&prefs);
 
     ledcWrite(TFT_BL_CHAN, prefs.brightness);
+
+    display_begin(&tft);
+    pipeline.begin();
 }
 
 void loop() {
     File fp;
-    int t_fstart=0, t_delay=0, t_real_delay, res, next_time, delay_until;
-    next_time = millis() + (prefs.display_time_s * 1000);
+    Frame *frame;
+    int next_time, dir = 0;
+    Rect prev_rect, dirty;
+    bool full_push = true, in_flight = false;
+    ProfSample sample;
+    bool sampled = false;
+    uint32_t idle_start, idle_us;
+    int count;
 
-    fp = SD.open(files.get_cur_file());
-    if (!fp) {
-        files.next_file(&prefs);
-        return;
+    // The catalog is refreshed in the background; switch to it once it's
+    // done. The first time there's no catalog to play from meanwhile
+    if ((count = catalog_poll()) >= 0)
+        files.reload(count);
+    if (!files.get_num_files()) {
+        files.rescan();
+        if (!files.get_num_files())
+            die("No GIFs found");
     }
+    next_time = millis() + (prefs.display_time_s * 1000);
 
-    gd_GIF *gif = gd_open_gif(&fp);
+    gd_GIF *gif = pipeline.take_prefetched(files.get_cur_file(), &fp);
     if (!gif) {
-        files.next_file(&prefs);
-        return;
+        fp = SD.open(files.get_cur_file());
+        if (!fp) {
+            // The catalog is out of date. If it wasn't, skip the file
+            if (!files.rescan())
+                files.next_file(&prefs);
+            return;
+        }
+
+        gif = Pipeline::open(&fp);
+        if (!gif) {
+            // Maybe there's no memory for its canvas; try it without one
+            fp.seek(0);
+            gif = gd_open_gif_scaled(&fp, SCREEN_W, SCREEN_H, PIPELINE_SCALE | GD_STREAM);
+            if (!gif) {
+                files.next_file(&prefs);
+                return;
+            }
+            dir = play_streamed(gif, next_time);
+            goto end_loop;
+        }
     }
 
+    // Frames are decoded on the other core from here on
+    pipeline.start(gif, files.get_cur_file());
+    scheduler.reset();
+    profiler_reset(files.get_cur_file());
+
     while (1) {
-        t_delay = gif->gce.delay * 10;
-        res = gd_get_frame(gif);
-        if (res < 0) {
+        while (!(frame = pipeline.acquire())) {
+            in_flight = reclaim(in_flight);
+            if ((dir = poll_buttons()) == BTN_MENU) {
+                full_push = true;
+            } else if (dir) {
+                goto end_loop;
+            }
+            delay(1);
+        }
+        if (frame->status < 0) {
             die("failure");
-        } else if (res == 0) {
-            gd_rewind(gif);
-            t_fstart = 0;
-            continue;
         }
-        gd_render_frame(gif, screen);
-        t_real_delay = t_delay - (millis() - t_fstart);
-        delay_until = millis() + t_real_delay;
-        do {
-            buttons.check();
-            if (buttons.l_btn()) {
-                files.prev_file(&prefs);
+        // Pixels can only have changed where the previous frame was (it may
+        // have been disposed) or where this one is
+        if (full_push) {
+            dirty = (Rect) {0, 0, SCREEN_W, SCREEN_H};
+        } else {
+            dirty = prev_rect;
+            rect_union(&dirty, &frame->rect);
+        }
+        prev_rect = frame->rect;
+        idle_start = micros();
+        while (!scheduler.due()) {
+            in_flight = reclaim(in_flight);
+            if ((dir = poll_buttons()) == BTN_MENU) {
+                // The menu drew over everything
+                dirty = (Rect) {0, 0, SCREEN_W, SCREEN_H};
+                idle_start = micros();
+            } else if (dir) {
                 goto end_loop;
             }
-            if (buttons.r_btn()) {
-                files.next_file(&prefs);
+            // Wake up sooner while a transfer is running so its buffer goes
+            // back to the decoder promptly
+            scheduler.sleep(in_flight ? SCHED_SPIN_US : BTN_POLL_US);
+        }
+
+        idle_us = micros() - idle_start;
+
+        // The previous frame has to be on screen before this one goes out
+        display_wait();
+        if (sampled) {
+            // The previous frame's transfer time is only known now
+            sample.us[PROF_PUSH] = display_push_us();
+            profiler_record(&sample);
+        }
+        in_flight = reclaim(in_flight);
+        display_push(frame->pixels, &dirty, frame->big_endian);
+        sample.us[PROF_EXT] = frame->timing.ext;
+        sample.us[PROF_LZW] = frame->timing.lzw;
+        sample.us[PROF_COMPOSE] = frame->timing.compose;
+        sample.us[PROF_IDLE] = idle_us;
+        sample.delay_cs = frame->delay;
+        sample.late = scheduler.shown(frame->delay);
+        sampled = true;
+        in_flight = true;
+        full_push = false;
+
+        if (prefs.display_time_s < 1000) {
+            if (millis() >= next_time) {
+                dir = 1;
                 goto end_loop;
             }
-            if (buttons.m_btn()) {
-                main_menu(&tft, &buttons, &prefs);
-                ledcWrite(TFT_BL_CHAN, prefs.brightness);
-            }
-        } while (millis() < delay_until);
-
-        tft.startWrite();
-        tft.writePixels(screen, 16384);
-        // for (int y = 127; y >= 0; y--) {
-        //     for (int x = 127; x >= 0; x--) {
-        //         tft.writePixels(screen + (y * 128) + x, 1);
-        //     }
-        // }
-        tft.endWrite();
-        t_fstart = millis();
-
-        if (prefs.display_time_s < 1000 && millis() >= next_time) {
-            files.next_file(&prefs);
-            goto end_loop;
+            if (millis() + PREFETCH_LEAD_MS >= next_time)
+                pipeline.prefetch(files.get_next_file());
         }
     }
 
 end_loop:
 
+    display_wait();
+    if (sampled) {
+        // The last frame shown won't be followed by another push to
+        // record it
+        sample.us[PROF_PUSH] = display_push_us();
+        profiler_record(&sample);
+    }
+    pipeline.pause();
     gd_close_gif(gif);
+    if (dir < 0)
+        files.prev_file(&prefs);
+    else
+        files.next_file(&prefs);
+}
+
+
+// Check the buttons. Returns -1/1 to go to the previous/next file, BTN_MENU
+// if the menu was shown (the screen needs a full redraw), 0 otherwise.
+int poll_buttons() {
+    buttons.check();
+    if (buttons.l_btn())
+        return -1;
+    if (buttons.r_btn())
+        return 1;
+    if (buttons.m_btn()) {
+        // Keep the decode task off the SD card while prefs may be written
+        display_wait();
+        if (!streaming)
+            pipeline.pause();
+        main_menu(&tft, &buttons, &prefs);
+        // While the card is free anyway
+        flush_prefs(true);
+        ledcWrite(TFT_BL_CHAN, prefs.brightness);
+        files.shuffle(prefs.shuffle_seed);
+        if (!streaming)
+            pipeline.resume();
+        return BTN_MENU;
+    }
+    return 0;
+}
+
+
+// Play a GIF opened with GD_STREAM until next_time or a button press: each
+// frame goes to the TFT a band at a time as it's decoded, with no canvas or
+// screen buffer, so GIFs there's no memory for otherwise still play. Returns
+// -1/1 to go to the previous/next file
+int play_streamed(gd_GIF* gif, int next_time) {
+    int dir = 0, status;
+
+    streaming = true;
+    gif->band = push_band;
+    display_wait();
+    tft.fillScreen(ST77XX_BLACK);
+    scheduler.reset();
+    while (!dir) {
+        while (!scheduler.due()) {
+            if ((dir = poll_buttons()) == BTN_MENU) {
+                // There's nothing to redraw from but the GIF itself
+                tft.fillScreen(ST77XX_BLACK);
+                gd_rewind(gif);
+                dir = 0;
+            } else if (dir) {
+                break;
+            }
+            // The decode task isn't running to write them
+            flush_prefs(false);
+            scheduler.sleep(BTN_POLL_US);
+        }
+        if (dir)
+            break;
+        status = gd_get_frame(gif);
+        if (status == 0) {
+            gd_rewind(gif);
+            status = gd_get_frame(gif);
+        }
+        if (status <= 0)
+            die("failure");
+        scheduler.shown(gif->gce.delay);
+        if (prefs.display_time_s < 1000 && millis() >= next_time)
+            dir = 1;
+    }
+    display_wait();
+    streaming = false;
+    return dir;
+}
+
+
+// gd_GIF band callback: queue the band for the TFT. The decoder leaves it
+// alone until the next call, and that waits for this transfer first
+void push_band(gd_GIF* gif, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t* pixels) {
+    Rect rect = {x, y, w, h};
+
+    display_push_band(pixels, &rect, gif->big_endian);
+}
+
+
+// Once the frame in flight has been sent, hand its buffer back to the decode
+// task. Returns whether a frame is still in flight
+bool reclaim(bool in_flight) {
+    if (in_flight && display_idle()) {
+        pipeline.release();
+        return false;
+    }
+    return in_flight;
 }
 
 
@@ -151,6 +332,7 @@ void die(const char *message) {
 
 
 void die(const char *message, bool dont_die) {
+    display_wait();
     tft.fillScreen(ST77XX_BLACK);
 
     tft.setTextWrap(true);